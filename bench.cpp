@@ -0,0 +1,410 @@
+/****************************************************************************
+** Microbenchmarks of the shapes and of the logical scene.
+**
+** Prints one CSV line per benchmark: name, nanoseconds per operation,
+** heap allocations per operation and number of operations. Then, after
+** an empty line, one CSV line per detection benchmark: name, rate of the
+** cases decided right, isInside calls per case and number of cases. An
+** optional argument only runs the benchmarks whose name contains it.
+****************************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include <QtWidgets>
+#include "objects.hpp"
+
+// Counts heap allocations of the whole process.
+static std::atomic<size_t> nb_allocations(0);
+
+void* operator new(size_t size)
+{
+  ++nb_allocations;
+  if (void* p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+  std::free(p);
+}
+
+static const char* filter = nullptr;
+// Results are accumulated here so that the compiler keeps the work.
+static volatile double sink = 0.0;
+
+// Runs `op` (which performs `ops_per_call` operations) repeatedly for
+// at least 200 ms, then prints its cost.
+template <typename Op>
+void bench(const char* name, Op op, int ops_per_call = 1)
+{
+  if (filter && !strstr(name, filter))
+    return;
+  op(); // warm up
+  QElapsedTimer timer;
+  qint64 calls = 0, ns = 0;
+  size_t allocations = 0;
+  for (qint64 n = 1; ns < 200000000; n *= 2) {
+    const size_t a0 = nb_allocations;
+    timer.start();
+    for (qint64 i = 0; i < n; ++i)
+      op();
+    ns += timer.nsecsElapsed();
+    allocations += nb_allocations - a0;
+    calls += n;
+  }
+  const double ops = double(calls) * ops_per_call;
+  printf("%s,%.2f,%.3f,%.0f\n", name, ns / ops, allocations / ops, ops);
+  fflush(stdout);
+}
+
+// Benchmarks isInside and randomPoint of a graphical shape, with points
+// taken in its bounding rectangle.
+void benchShape(const std::string& name, GraphicalShape* shape)
+{
+  const QRectF r = shape->boundingRect();
+  QRandomGenerator rg(1);
+  std::vector<QPointF> points(1024);
+  std::vector<float> xs(points.size()), ys(points.size());
+  std::vector<uint8_t> in(points.size());
+  for (size_t i = 0; i < points.size(); ++i) {
+    points[i] = QPointF(r.left() + rg.generateDouble() * r.width(),
+                        r.top() + rg.generateDouble() * r.height());
+    xs[i] = points[i].x();
+    ys[i] = points[i].y();
+  }
+  bench((name + "::isInside").c_str(), [&]() {
+    int n = 0;
+    for (const QPointF& p : points)
+      n += shape->isInside(p);
+    sink = sink + n;
+  }, int(points.size()));
+  bench((name + "::isInsideBatch").c_str(), [&]() {
+    shape->isInsideBatch(xs.data(), ys.data(), in.data(), in.size());
+    sink = sink + in[0];
+  }, int(points.size()));
+  RandomStream rng;
+  bench((name + "::randomPoint").c_str(), [&]() {
+    sink = sink + shape->randomPoint(rng).x();
+  });
+}
+
+// Prints the line of a detection benchmark, after the header of their
+// table if it is the first one.
+void printDetection(const char* name, double right, double tests, int cases)
+{
+  static bool header = false;
+  if (!header)
+    printf("\nname,rate,inside_tests_per_case,cases\n");
+  header = true;
+  printf("%s,%.4f,%.2f,%d\n", name, right / cases, tests / cases, cases);
+  fflush(stdout);
+}
+
+// Tests random pairs of overlapping nice asteroids, whose images are
+// sampled, with both samplings. Each pair is tested in a scene of its
+// own, so that no witness is reused. A pair overlaps if a point of the
+// pixel grid is in both shapes, and pairs overlapping by fewer than 100
+// pixels are also counted apart.
+void benchSampling(QPixmap& asteroid_pixmap)
+{
+  const char* names[2][2] = {
+    { "LogicalScene::step/sampling/uniform", "LogicalScene::step/sampling/adaptive" },
+    { "LogicalScene::step/sampling-shallow/uniform", "LogicalScene::step/sampling-shallow/adaptive" } };
+  bool selected = !filter;
+  for (auto& row : names)
+    for (const char* name : row)
+      selected = selected || strstr(name, filter);
+  if (!selected)
+    return;
+  const QColor c(0, 0, 0);
+  const LogicalScene::Sampling samplings[2] = { LogicalScene::Uniform, LogicalScene::Adaptive };
+  QRandomGenerator rg(1);
+  double found[2][2] = {}, tests[2][2] = {};
+  int cases[2] = { 0, 0 };
+  while (cases[0] < 500) {
+    // The rectangle of the second shape is centered around the one of
+    // the first shape.
+    NiceAsteroid a(c, c, 0.0, asteroid_pixmap), b(c, c, 0.0, asteroid_pixmap);
+    a.restore(ShapeSnapshot{ QPointF(IMAGE_SIZE / 2.0, IMAGE_SIZE / 2.0), rg.generateDouble() * 360.0,
+                             rg.generateDouble() * 360.0, MasterShape::Ok });
+    b.restore(ShapeSnapshot{ a.pos(), rg.generateDouble() * 360.0, rg.generateDouble() * 360.0, MasterShape::Ok });
+    b.setPos(b.pos() + a.boundingRect().center() - b.boundingRect().center()
+             + QPointF(rg.generateDouble() * 300.0 - 150.0, rg.generateDouble() * 300.0 - 150.0));
+    const QRectF r = a.boundingRect() & b.boundingRect();
+    int overlap = 0;
+    for (qreal y = ::floor(r.top()) + 0.5; y < r.bottom(); ++y)
+      for (qreal x = ::floor(r.left()) + 0.5; x < r.right(); ++x)
+        overlap += a.isInside(QPointF(x, y)) && b.isInside(QPointF(x, y));
+    if (overlap == 0)
+      continue;
+    const int shallow = overlap < 100;
+    for (int m = 0; m < 2; ++m) {
+      NiceAsteroid f1(c, c, 0.0, asteroid_pixmap), f2(c, c, 0.0, asteroid_pixmap);
+      f1.restore(a.snapshot());
+      f2.restore(b.snapshot());
+      LogicalScene scene(100);
+      scene.setThreadCount(1);
+      scene.seed = quint64(cases[0]);
+      scene.sampling = samplings[m];
+      scene.add(&f1);
+      scene.add(&f2);
+      scene.step();
+      for (int k = 0; k <= shallow; ++k) {
+        found[k][m] += !scene.contacts().empty();
+        tests[k][m] += scene.perf.inside_tests;
+      }
+    }
+    ++cases[0];
+    cases[1] += shallow;
+  }
+  for (int k = 0; k < 2; ++k)
+    for (int m = 0; m < 2; ++m)
+      if (cases[k] > 0 && (!filter || strstr(names[k][m], filter)))
+        printDetection(names[k][m], found[k][m], tests[k][m], cases[k]);
+}
+
+// Classifies points within 0.05 pixel of the edge of an asteroid far
+// from the origin of the largest world with isInsideBatch, given as
+// floats relative to the origin of the scene or to the asteroid. Points
+// are classified right if isInside, in double precision, agrees.
+void benchPrecision()
+{
+  const char* names[2] = { "MasterShape::isInsideBatch/far/absolute", "MasterShape::isInsideBatch/far/relative" };
+  if (filter && !strstr(names[0], filter) && !strstr(names[1], filter))
+    return;
+  const QColor c(0, 0, 0);
+  Asteroid asteroid(c, c, 0.0, 30.0);
+  asteroid.setPos(999123.0, 998765.0);
+  const QPointF origins[2] = { QPointF(), asteroid.pos() };
+  QRandomGenerator rg(1);
+  const int n = 100000;
+  std::vector<QPointF> points(n);
+  for (auto& p : points) {
+    const double a = rg.generateDouble() * 2.0 * Pi, d = 30.0 + rg.generateDouble() * 0.1 - 0.05;
+    p = asteroid.pos() + QPointF(d * ::cos(a), d * ::sin(a));
+  }
+  std::vector<float> xs(n), ys(n);
+  std::vector<uint8_t> in(n);
+  for (int k = 0; k < 2; ++k) {
+    if (filter && !strstr(names[k], filter))
+      continue;
+    for (int i = 0; i < n; ++i) {
+      xs[i] = float(points[i].x() - origins[k].x());
+      ys[i] = float(points[i].y() - origins[k].y());
+    }
+    asteroid.isInsideBatch(xs.data(), ys.data(), in.data(), size_t(n), origins[k]);
+    int right = 0;
+    for (int i = 0; i < n; ++i)
+      right += bool(in[i]) == asteroid.isInside(points[i]);
+    printDetection(names[k], right, 1.0 * n, n);
+  }
+}
+
+// Runs a random scene of 100 shapes with discrete and continuous
+// detection side by side, and counts the contacts of the discrete mode
+// that the continuous mode also finds. Then two fast asteroids cross
+// each other between two ticks, which only the continuous mode sees.
+void benchContinuous(QPixmap& asteroid_pixmap)
+{
+  const char* names[3] = { "LogicalScene::tick/continuous/discrete-contacts",
+                           "LogicalScene::tick/head-on/discrete", "LogicalScene::tick/head-on/continuous" };
+  const QColor c(0, 0, 0);
+  if (!filter || strstr(names[0], filter)) {
+    LogicalScene discrete(100), continuous(100);
+    continuous.continuous = true;
+    SceneParams params;
+    params.asteroids = 70;
+    params.trucks = 20;
+    params.enterprises = 5;
+    params.nices = 5;
+    discrete.populate(params, asteroid_pixmap);
+    continuous.populate(params, asteroid_pixmap);
+    // Both scenes move their shapes the same way.
+    int cases = 0;
+    double found = 0.0, tests = 0.0;
+    for (int t = 0; t < 1000; ++t) {
+      discrete.tick();
+      continuous.tick();
+      const std::vector<LogicalScene::Contact>& contacts = continuous.contacts();
+      for (const LogicalScene::Contact& d : discrete.contacts()) {
+        ++cases;
+        found += std::any_of(contacts.begin(), contacts.end(), [&](const LogicalScene::Contact& k) {
+          return k.id1 == d.id1 && k.id2 == d.id2;
+        });
+      }
+      tests += continuous.perf.inside_tests;
+    }
+    if (cases > 0)
+      printDetection(names[0], found, tests, cases);
+    for (LogicalScene* scene : { &discrete, &continuous })
+      for (auto f : scene->formes)
+        delete f;
+  }
+  for (int k = 0; k < 2; ++k) {
+    if (filter && !strstr(names[1 + k], filter))
+      continue;
+    // 35 pixels apart before the tick and 25 after, for a sum of radii
+    // of 20.
+    Asteroid a(c, c, 30.0, 10.0), b(c, c, 30.0, 10.0);
+    a.setPos(100.0, IMAGE_SIZE / 2.0);
+    b.setPos(135.0, IMAGE_SIZE / 2.0);
+    b.setRotation(180.0);
+    LogicalScene scene(100);
+    scene.continuous = k == 1;
+    scene.add(&a);
+    scene.add(&b);
+    scene.tick();
+    printDetection(names[1 + k], !scene.contacts().empty(), double(scene.perf.inside_tests), 1);
+  }
+}
+
+// Builds a scene of n shapes, mostly asteroids, in a world of the given
+// size, and benchmarks its ticks.
+void benchScene(int n, QPixmap& asteroid_pixmap, qreal world_size = IMAGE_SIZE)
+{
+  std::string name = "LogicalScene::tick/" + std::to_string(n);
+  if (world_size != IMAGE_SIZE)
+    name += "/world" + std::to_string(int(world_size));
+  if (filter && !strstr(name.c_str(), filter))
+    return;
+  LogicalScene scene(100);
+  scene.setWorld(World(world_size, SZ_BD));
+  SceneParams params;
+  params.trucks = std::max(n / 5, 1);
+  params.enterprises = std::max(n / 20, 1);
+  params.nices = std::max(n / 20, 1);
+  params.asteroids = std::max(n - params.trucks - params.enterprises - params.nices, 0);
+  scene.populate(params, asteroid_pixmap);
+  bench(name.c_str(), [&]() { scene.tick(); });
+  for (auto f : scene.formes)
+    delete f;
+}
+
+// Saves a scene of n shapes, then benchmarks loading it, per shape.
+void benchLoad(int n, QPixmap& asteroid_pixmap)
+{
+  const std::string name = "LogicalScene::load/" + std::to_string(n);
+  if (filter && !strstr(name.c_str(), filter))
+    return;
+  const QString file = QDir::temp().filePath("bench_scene.bin");
+  {
+    LogicalScene scene(100);
+    SceneParams params;
+    params.trucks = params.enterprises = params.nices = 0;
+    params.asteroids = n;
+    scene.populate(params, asteroid_pixmap);
+    scene.save(file);
+    for (auto f : scene.formes)
+      delete f;
+  }
+  bench(name.c_str(), [&]() {
+    LogicalScene scene(100);
+    scene.load(file, asteroid_pixmap);
+    for (auto f : scene.formes)
+      delete f;
+  }, n);
+  QFile::remove(file);
+}
+
+int main(int argc, char** argv)
+{
+  qputenv("QT_QPA_PLATFORM", "offscreen");
+  QApplication app(argc, argv);
+  if (argc > 1)
+    filter = argv[1];
+  logical_scene = new LogicalScene(100);
+  QPixmap asteroid_pixmap(":/images/asteroid.gif");
+  QColor c(0, 0, 0);
+
+  printf("name,ns_per_op,allocs_per_op,ops\n");
+
+  // Primitives.
+  Asteroid asteroid(c, c, 0.0, 30.0);
+  Disk disk(30.0, &asteroid);
+  Rectangle rectangle(QPointF(-80, -10), QPointF(0, 10), &asteroid);
+  ImageShape image(asteroid_pixmap, &asteroid);
+  Transformation* transformation =
+      new Transformation(new Rectangle(QPointF(-25, -5), QPointF(25, 5), &asteroid),
+                         QPointF(-30.0, 0.0), 45.0);
+  Union* union_shape = new Union(new Disk(30.0, &asteroid),
+                                 new Rectangle(QPointF(-80, -10), QPointF(0, 10), &asteroid));
+  benchShape("Disk", &disk);
+  benchShape("Rectangle", &rectangle);
+  benchShape("ImageShape", &image);
+  benchShape("Transformation", transformation);
+  benchShape("Union", union_shape);
+  StaticShape<SpaceTruck::Shape> static_truck(&asteroid);
+  benchShape("StaticShape<SpaceTruck::Shape>", &static_truck);
+
+  // Composite shapes, placed in the scene as in the simulation.
+  SpaceTruck truck(c, c, 0.0);
+  Enterprise enterprise(c, c, 0.0);
+  NiceAsteroid nice(c, c, 0.0, asteroid_pixmap);
+  for (MasterShape* f : std::vector<MasterShape*>{&truck, &enterprise, &nice}) {
+    f->setPos(IMAGE_SIZE / 2.0, IMAGE_SIZE / 2.0);
+    f->setRotation(30.0);
+  }
+  benchShape("SpaceTruck", &truck);
+  benchShape("Enterprise", &enterprise);
+  benchShape("NiceAsteroid", &nice);
+
+  // Creation and destruction of shapes, on the heap and in an arena.
+  std::vector<MasterShape*> trucks(1000);
+  bench("SpaceTruck::new/heap", [&]() {
+    for (auto& f : trucks)
+      f = new SpaceTruck(c, c, 0.0);
+    for (auto f : trucks)
+      delete f;
+  }, int(trucks.size()));
+  bench("SpaceTruck::new/arena", [&]() {
+    ShapeArena arena;
+    ShapeArena::Scope scope(arena);
+    for (auto& f : trucks)
+      f = new SpaceTruck(c, c, 0.0);
+    for (auto f : trucks)
+      delete f;
+  }, int(trucks.size()));
+
+  // Pairs of overlapping shapes.
+  SpaceTruck truck2(c, c, 0.0);
+  NiceAsteroid nice2(c, c, 0.0, asteroid_pixmap);
+  truck2.setPos(IMAGE_SIZE / 2.0 + 20.0, IMAGE_SIZE / 2.0 + 15.0);
+  nice2.setPos(IMAGE_SIZE / 2.0 + 20.0, IMAGE_SIZE / 2.0 + 15.0);
+  bench("LogicalScene::intersect/SpaceTruck-Enterprise", [&]() {
+    sink = sink + logical_scene->intersect(&truck, &enterprise);
+  });
+  bench("LogicalScene::intersect/SpaceTruck-SpaceTruck", [&]() {
+    sink = sink + logical_scene->intersect(&truck, &truck2);
+  });
+  bench("LogicalScene::intersect/NiceAsteroid-NiceAsteroid", [&]() {
+    sink = sink + logical_scene->intersect(&nice, &nice2);
+  });
+
+  // Full scenes.
+  for (int n : {10, 100, 1000, 10000})
+    benchScene(n, asteroid_pixmap);
+  benchScene(10000, asteroid_pixmap, 1e6);
+  benchLoad(100000, asteroid_pixmap);
+
+  // Detection rates.
+  benchSampling(asteroid_pixmap);
+  benchPrecision();
+  benchContinuous(asteroid_pixmap);
+
+  delete transformation;
+  delete union_shape;
+  return 0;
+}
@@ -0,0 +1,25 @@
+
+# Qt configuration file of the microbenchmarks.
+# Run `qmake bench.pro` once, then `make -f Makefile.bench`, then `./bench`.
+
+QT += widgets
+CONFIG += c++11 console
+CONFIG -= app_bundle
+# Uncomment to enable the AVX2 kernels of isInsideBatch (SSE2 otherwise).
+# QMAKE_CXXFLAGS += -mavx2
+
+TARGET = bench
+MAKEFILE = Makefile.bench
+OBJECTS_DIR = .bench
+RCC_DIR = .bench
+
+HEADERS += \
+	objects.hpp
+
+SOURCES += \
+	bench.cpp \
+        objects.cpp
+
+RESOURCES += \
+	collider.qrc
+
@@ -6,6 +6,7 @@
 ** Contact: http://www.qt.io/licensing/
 ****************************************************************************/
 
+#include <algorithm>
 #include <cmath>
 #include <QtWidgets>
 #include "objects.hpp"
@@ -14,19 +15,24 @@ static const int AsteroidCount = -1;
 static const int RectangleCount = 2;
 static const int EnterpriseCount = 1;
 static const int NiceCount = 3;
-QRandomGenerator RGMain;
+
+// Memory of the many shapes created by the tests below.
+static ShapeArena test_arena;
 
 void testLogicalView(MasterShape* shape, QGraphicsScene& view) {
     QColor cko( 255, 240, 0 );
+    RandomStream rng;
+    ShapeArena::Scope scope( test_arena );
     for (int i = 0; i < 10000; ++i) {
         MasterShape* asteroid = new Asteroid( cko, cko, 0, 1);
-        asteroid->setPos(shape->randomPoint());
+        asteroid->setPos(shape->randomPoint(rng));
         view.addItem( asteroid );
     }
 }
 
 void testIsInside(MasterShape* shape, QGraphicsScene& view) {
     QColor cko( 255, 240, 0 );
+    ShapeArena::Scope scope( test_arena );
     for (int i = 0; i < IMAGE_SIZE; ++i) {
         for (int j = 0; j < IMAGE_SIZE; ++j) {
             if (shape->isInside(QPointF(i,j))) {
@@ -57,108 +63,291 @@ void testBoundingRect(MasterShape* shape, QGraphicsScene& view) {
     view.addItem( a4 );
 }
 
+// A view that measures its painting time for the logical scene and may
+// draw the counters of the last tick, as published by the simulation,
+// over the scene.
+class PerfView : public QGraphicsView {
+public:
+  PerfView(QGraphicsScene* scene, bool hud, const PerfCounters* perf)
+    : QGraphicsView(scene), _hud(hud), _perf(perf), _paint_ns(0) {}
+
+protected:
+  void paintEvent(QPaintEvent* event) override {
+    if (!logical_scene->instrumented) {
+      QGraphicsView::paintEvent(event);
+      return;
+    }
+    // The painting counts for the tick whose snapshot is displayed.
+    QElapsedTimer timer;
+    timer.start();
+    QGraphicsView::paintEvent(event);
+    _paint_ns = timer.nsecsElapsed();
+    logical_scene->addPaintTime(_perf->tick, _paint_ns);
+  }
+
+  void drawForeground(QPainter* painter, const QRectF&) override {
+    if (!_hud)
+      return;
+    const PerfCounters& p = *_perf;
+    const QStringList lines = {
+      QString("tick           %1").arg(p.tick),
+      QString("pairs          %1").arg(p.pairs),
+      QString("witness hits   %1").arg(p.witness_hits),
+      QString("culled         %1").arg(p.culled),
+      QString("random points  %1").arg(p.random_points),
+      QString("inside tests   %1").arg(p.inside_tests),
+      QString("move (ms)      %1").arg(p.move_ns * 1e-6, 0, 'f', 3),
+      QString("collision (ms) %1").arg(p.collision_ns * 1e-6, 0, 'f', 3),
+      QString("paint (ms)     %1").arg(_paint_ns * 1e-6, 0, 'f', 3) };
+    // The counters stay in the top left corner of the viewport.
+    painter->save();
+    painter->resetTransform();
+    painter->setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+    const int h = painter->fontMetrics().height();
+    painter->fillRect(QRect(4, 4, 16 * h, (lines.size() + 1) * h), QColor(0, 0, 0, 160));
+    painter->setPen(Qt::white);
+    for (int i = 0; i < lines.size(); ++i)
+      painter->drawText(QPoint(4 + h / 2, 4 + (i + 1) * h), lines[i]);
+    painter->restore();
+  }
+
+  bool _hud;
+  const PerfCounters* _perf;
+  qint64 _paint_ns; ///< time of the last painting
+};
+
+// Runs the simulation without display for the given number of ticks,
+// then prints the speed of the simulation and collision statistics.
+int runHeadless(int ticks)
+{
+  QTextStream out(stdout);
+  double colliding = 0.0, pairs = 0.0, hits = 0.0, began = 0.0;
+  int max_colliding = 0;
+  QElapsedTimer timer;
+  timer.start();
+  for (int t = 0; t < ticks; ++t) {
+    logical_scene->tick();
+    int n = 0;
+    for (auto f : logical_scene->formes)
+      n += f->currentState() == MasterShape::Collision;
+    colliding += n;
+    max_colliding = std::max(max_colliding, n);
+    pairs += logical_scene->nbCandidatePairs();
+    hits += logical_scene->nbWitnessHits();
+    began += logical_scene->contactsBegan().size();
+  }
+  logical_scene->flushPerf();
+  const double seconds = timer.nsecsElapsed() * 1e-9;
+  out << "shapes:                " << logical_scene->formes.size() << "\n"
+      << "threads:               " << logical_scene->nb_threads << "\n"
+      << "ticks:                 " << ticks << "\n"
+      << "time (s):              " << seconds << "\n"
+      << "ticks/s:               " << ticks / seconds << "\n"
+      << "candidate pairs/tick:  " << pairs / ticks << "\n"
+      << "witness hits/tick:     " << hits / ticks << "\n"
+      << "colliding shapes/tick: " << colliding / ticks << "\n"
+      << "max colliding shapes:  " << max_colliding << "\n"
+      << "new contacts/tick:     " << began / ticks << "\n";
+  return 0;
+}
+
 int main(int argc, char **argv)
 {
+  // A headless run must not need a display.
+  for (int i = 1; i < argc; ++i)
+    if (QString(argv[i]) == "--headless")
+      qputenv("QT_QPA_PLATFORM", "offscreen");
   // Initializes Qt.
   QApplication app(argc, argv);
-  // Initializes the random generator.
-  srand(QTime(0, 0, 0).secsTo(QTime::currentTime()));
 
-  // Creates a graphics scene where we will put graphical objects.
-  QGraphicsScene graphical_scene;
-  graphical_scene.setSceneRect(0, 0, IMAGE_SIZE, IMAGE_SIZE);
-  graphical_scene.setItemIndexMethod(QGraphicsScene::NoIndex);
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Collisions of asteroids and space ships.");
+  parser.addHelpOption();
+  QCommandLineOption headlessOption("headless", "Runs the simulation without display.");
+  QCommandLineOption ticksOption("ticks", "Number of ticks of a headless run.", "n", "1000");
+  QCommandLineOption seedOption("seed", "Master seed of all random generators.", "seed", "1");
+  QCommandLineOption threadsOption("threads", "Number of threads of the collision tests.", "n",
+                                   QString::number(QThread::idealThreadCount()));
+  QCommandLineOption samplingOption("sampling", "Sampling of bitmap shapes: adaptive or uniform.",
+                                    "mode", "adaptive");
+  QCommandLineOption asteroidsOption("asteroids", "Number of asteroids.", "n",
+                                     QString::number(std::max(AsteroidCount, 0)));
+  QCommandLineOption trucksOption("trucks", "Number of space trucks.", "n",
+                                  QString::number(RectangleCount));
+  QCommandLineOption enterprisesOption("enterprises", "Number of enterprises.", "n",
+                                       QString::number(EnterpriseCount));
+  QCommandLineOption nicesOption("nices", "Number of nice asteroids.", "n",
+                                 QString::number(NiceCount));
+  QCommandLineOption hudOption("hud", "Shows the counters of each tick over the view.");
+  QCommandLineOption perfOption("perf-csv", "Writes the counters of each tick as CSV (- for stdout).",
+                                "file");
+  QCommandLineOption sceneOption("scene", "Loads the shapes from a scene file instead of placing them.",
+                                 "file");
+  QCommandLineOption saveSceneOption("save-scene", "Saves the initial shapes to a scene file.", "file");
+  QCommandLineOption recordOption("record", "Records the ticks in a log file.", "file");
+  QCommandLineOption replayOption("replay", "Displays the ticks of a log file, without simulation.",
+                                  "file");
+  QCommandLineOption continuousOption("continuous", "Tests collisions along the moves of shapes.");
+  QCommandLineOption worldOption("world", "Side of the world, from 600 to 1000000, unless given by a scene "
+                                 "file or a log. The view shows a part of it.",
+                                 "size", QString::number(IMAGE_SIZE));
+  for (auto option : {headlessOption, ticksOption, seedOption, threadsOption, samplingOption,
+                      asteroidsOption, trucksOption, enterprisesOption, nicesOption,
+                      hudOption, perfOption, sceneOption, saveSceneOption,
+                      recordOption, replayOption, continuousOption, worldOption})
+    parser.addOption(option);
+  parser.process(app);
+
+  // Initializes the random generators.
+  const quint32 seed = parser.value(seedOption).toUInt();
+  srand(seed);
+
+  const World world( std::min(std::max(parser.value(worldOption).toDouble(), MIN_WORLD_SIZE), MAX_WORLD_SIZE), SZ_BD );
 
   // We choose to check intersection with 100 random points.
   logical_scene = new LogicalScene( 100 );
+  logical_scene->setWorld( world );
+  logical_scene->seed = seed;
+  logical_scene->setThreadCount( parser.value(threadsOption).toInt() );
+  if (parser.value(samplingOption) == "uniform")
+    logical_scene->sampling = LogicalScene::Uniform;
+  logical_scene->continuous = parser.isSet(continuousOption);
+  logical_scene->instrumented = parser.isSet(hudOption);
+  QFile perf_file;
+  QTextStream perf_stream;
+  if (parser.isSet(perfOption)) {
+    const QString name = parser.value(perfOption);
+    if (name == "-")
+      perf_file.open(stdout, QIODevice::WriteOnly);
+    else
+      perf_file.setFileName(name), perf_file.open(QIODevice::WriteOnly | QIODevice::Text);
+    perf_stream.setDevice(&perf_file);
+    logical_scene->setPerfOutput(&perf_stream);
+  }
 
   QPixmap* asteroid_pixmap = new QPixmap(":/images/asteroid.gif");
-
-  for (int i = 0; i < AsteroidCount; ++i) {
-    QColor cok( 150, 130, 110 );
-    QColor cko( 255, 240, 0 );
-
-    // A master shape gathers all the elements of the shape.
-    MasterShape* asteroid = new Asteroid( cok, cko,
-                                          RGMain.generateDouble() * 2 + 2  /* speed */,
-                                          10. + RGMain.generateDouble() * 40. /* radius */ );
-    // Set direction and position
-    asteroid->setRotation(RGMain.generateDouble() * 360);
-    asteroid->setPos( IMAGE_SIZE/2 + ::sin((i * 6.28) / AsteroidCount) * 200,
-                      IMAGE_SIZE/2 + ::cos((i * 6.28) / AsteroidCount) * 200 );
-    // Add it to the graphical scene
-    graphical_scene.addItem( asteroid );
-    // and to the logical scene
-    logical_scene->formes.push_back( asteroid );
+  SceneParams params;
+  params.asteroids = parser.value(asteroidsOption).toInt();
+  params.trucks = parser.value(trucksOption).toInt();
+  params.enterprises = parser.value(enterprisesOption).toInt();
+  params.nices = parser.value(nicesOption).toInt();
+  // Shapes are loaded from a scene file, or placed as given by the
+  // number of shapes of each kind.
+  const QString scene_file = parser.value(sceneOption);
+  auto build = [&](LogicalScene& scene) {
+    if (scene_file.isEmpty()) {
+      scene.populate( params, *asteroid_pixmap );
+      return true;
+    }
+    return scene.load( scene_file, *asteroid_pixmap );
+  };
+  QTextStream err(stderr);
+  // A replay only displays the shapes of its log.
+  const bool replaying = parser.isSet(replayOption);
+  if (replaying && parser.isSet(headlessOption)) {
+    err << "A replay is only displayed: --headless cannot be used with --replay\n";
+    return 1;
   }
-
-  for (int i = 0; i < RectangleCount; ++i) {
-    QColor cok( 0, 130, 0 );
-    QColor cko( 255, 240, 0 );
-
-    // A master shape gathers all the elements of the shape.
-    MasterShape* spaceTruck = new SpaceTruck( cok, cko,
-                                              RGMain.generateDouble() * 2. + 2. /* speed */);
-    // Set direction and position
-    spaceTruck->setRotation(RGMain.generateDouble() * 360.);
-    spaceTruck->setPos( IMAGE_SIZE/2 + ::sin((i * 6.28) / RectangleCount) * 200,
-                      IMAGE_SIZE/2 + ::cos((i * 6.28) / RectangleCount) * 200 );
-    // Add it to the graphical scene
-    graphical_scene.addItem( spaceTruck );
-    // and to the logical scene
-    logical_scene->formes.push_back( spaceTruck );
+  Replay replay;
+  if (replaying && !replay.open(parser.value(replayOption), *asteroid_pixmap)) {
+    err << "Cannot read the log file " << parser.value(replayOption) << "\n";
+    return 1;
   }
-
-  for (int i = 0; i < EnterpriseCount; ++i) {
-    QColor cok( 150, 0, 0 );
-    QColor cko( 255, 240, 0 );
-
-    // A master shape gathers all the elements of the shape.
-    MasterShape* enterprise = new Enterprise( cok, cko,
-                                              RGMain.generateDouble() * 2. + 1.);
-    enterprise->setPos( IMAGE_SIZE/2.0, IMAGE_SIZE/2.0);
-    // Add it to the graphical scene
-    graphical_scene.addItem( enterprise );
-    //testLogicalView(enterprise, graphical_scene);
-    // and to the logical scene
-    logical_scene->formes.push_back( enterprise );
+  if (!replaying && !build(*logical_scene)) {
+    err << "Cannot load the scene file " << scene_file << "\n";
+    return 1;
   }
-  
-  for (int i = 0; i < NiceCount; ++i) {
-      QColor cok( 150, 130, 110 );
-      QColor cko( 255, 240, 0 );
-      MasterShape* nice_asteroid = new NiceAsteroid( cok, cko,
-                                                     RGMain.generateDouble() * 2. + 1. /* speed */,
-                                              *asteroid_pixmap);
-      nice_asteroid->setPos( IMAGE_SIZE/2 + ::sin((i * 6.28) / NiceCount) * 200,
-                          IMAGE_SIZE/2 + ::cos((i * 6.28) / NiceCount) * 200 );
-      nice_asteroid->setRotation(RGMain.generateDouble() * 360.);
-      graphical_scene.addItem( nice_asteroid );
-      //testLogicalView(nice_asteroid, graphical_scene);
-      //testIsInside(nice_asteroid, graphical_scene);
-      //testBoundingRect(nice_asteroid, graphical_scene);
-      logical_scene->formes.push_back( nice_asteroid );
+  if (parser.isSet(saveSceneOption) && !logical_scene->save(parser.value(saveSceneOption))) {
+    err << "Cannot save the scene file " << parser.value(saveSceneOption) << "\n";
+    return 1;
+  }
+  Recorder recorder(*logical_scene);
+  if (parser.isSet(recordOption) && !replaying) {
+    if (!recorder.open(parser.value(recordOption))) {
+      err << "Cannot create the log file " << parser.value(recordOption) << "\n";
+      return 1;
     }
+    logical_scene->recorder = &recorder;
+  }
+  // The log is complete only if the writer thread wrote every tick.
+  auto closeLog = [&](int result) {
+    if (parser.isSet(recordOption) && !replaying && !recorder.close()) {
+      err << "Cannot write the log file " << parser.value(recordOption) << "\n";
+      return 1;
+    }
+    return result;
+  };
+
+  if (parser.isSet(headlessOption))
+    return closeLog( runHeadless( parser.value(ticksOption).toInt() ) );
+  // Scene files and logs bring their own world.
+  const World shown_world = replaying ? replay.scene.world : logical_scene->world;
 
+  // The simulated shapes belong to the simulation thread: the view shows
+  // twin shapes, built with the same parameters and seed, which copy
+  // their snapshots.
+  LogicalScene display_scene( 100 );
+  display_scene.setWorld( shown_world );
+  display_scene.seed = seed;
+  if (!replaying)
+    build(display_scene);
+  const std::vector<MasterShape*>& shown = replaying ? replay.scene.formes : display_scene.formes;
 
-  QGraphicsView view(&graphical_scene);
+  // Creates a graphics scene where we will put graphical objects. It
+  // covers the whole world, borders included.
+  QGraphicsScene graphical_scene;
+  graphical_scene.setSceneRect(-shown_world.border, -shown_world.border, shown_world.period(),
+                               shown_world.period());
+  graphical_scene.setItemIndexMethod(QGraphicsScene::NoIndex);
+  for (auto f : shown) {
+    graphical_scene.addItem( f );
+    //testLogicalView(f, graphical_scene);
+    //testIsInside(f, graphical_scene);
+    //testBoundingRect(f, graphical_scene);
+  }
+
+  PerfCounters perf;
+  PerfView view(&graphical_scene, parser.isSet(hudOption), &perf);
   view.setRenderHint(QPainter::Antialiasing);
   view.setBackgroundBrush(QPixmap(":/images/stars.jpg"));
   view.setCacheMode(QGraphicsView::CacheBackground);
-  view.setViewportUpdateMode(QGraphicsView::BoundingRectViewportUpdate);
-  view.setDragMode(QGraphicsView::NoDrag); // QGraphicsView::ScrollHandDrag
+  // The counters are redrawn with the whole viewport.
+  view.setViewportUpdateMode(parser.isSet(hudOption) ? QGraphicsView::FullViewportUpdate
+                                                     : QGraphicsView::BoundingRectViewportUpdate);
+  // The view is a camera on a part of the world, starting at its
+  // center, which is moved by dragging.
+  view.setDragMode(QGraphicsView::ScrollHandDrag);
   view.setWindowTitle(QT_TRANSLATE_NOOP(QGraphicsView, "Space - the final frontier"));
   view.setHorizontalScrollBarPolicy ( Qt::ScrollBarAlwaysOff );
   view.setVerticalScrollBarPolicy ( Qt::ScrollBarAlwaysOff );
   view.resize( IMAGE_SIZE, IMAGE_SIZE );
+  view.centerOn( shown_world.size / 2, shown_world.size / 2 );
   view.show();
 
-  // Creates a timer that will call `advance()` method regularly.
+  // The simulation ticks every 30ms in its own thread, while a timer
+  // displays its last snapshot at about 60 frames per second. A replay
+  // plays one tick of its log every 30ms.
+  Simulation simulation( logical_scene, 30 );
+  std::vector<ShapeSnapshot> snapshots;
   QTimer timer;
-  QObject::connect(&timer, SIGNAL(timeout()), &graphical_scene, SLOT(advance()));
-  timer.start( 30 ); // every 30ms
-  
-  return app.exec();
-}
-
+  QObject::connect(&timer, &QTimer::timeout, [&]() {
+      if (replaying) {
+        if (!replay.next())
+          timer.stop();
+      } else if (simulation.latest(snapshots, perf)) {
+        Simulation::restore(display_scene.formes, snapshots);
+        if (parser.isSet(hudOption))
+          view.viewport()->update();
+      }
+  });
+  timer.start( replaying ? 30 : 16 );
+  if (!replaying)
+    simulation.start();
 
+  const int result = app.exec();
+  simulation.stop();
+  simulation.wait();
+  // The scene is never destroyed, and the stream of counters is local.
+  logical_scene->flushPerf();
+  return closeLog( result );
+}
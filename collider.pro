@@ -3,6 +3,8 @@
 
 QT += widgets
 CONFIG += c++11
+# Uncomment to enable the AVX2 kernels of isInsideBatch (SSE2 otherwise).
+# QMAKE_CXXFLAGS += -mavx2
   
 HEADERS += \
 	objects.hpp
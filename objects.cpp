@@ -8,22 +8,670 @@
 
 #include <cmath>
 #include <cassert>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <QGraphicsScene>
 #include <QRandomGenerator>
+#include <QThread>
 #include <QPainter>
 #include <QStyleOption>
 #include <QBitmap>
 #include <QImage>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <QFile>
 #include "objects.hpp"
 #include <iostream>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-static const double Pi = 3.14159265358979323846264338327950288419717;
 // static double TwoPi = 2.0 * Pi;
 
+double degreToRadian(double angle)
+{
+    return angle * Pi / 180;
+}
+
 // Global variables for simplicity.
-QRandomGenerator RG;
 LogicalScene *logical_scene = 0;
 
+///////////////////////////////////////////////////////////////////////////////
+// class RandomStream
+///////////////////////////////////////////////////////////////////////////////
+
+// Scrambles x (splitmix64), used to derive well mixed states from seeds.
+static uint64_t splitmix64(uint64_t &x)
+{
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+RandomStream::RandomStream(uint64_t seed, uint64_t stream)
+{
+    uint64_t x = seed;
+    x = splitmix64(x) ^ stream;
+    for (int i = 0; i < 4; ++i)
+        s[i] = splitmix64(x);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// class AliasTable
+///////////////////////////////////////////////////////////////////////////////
+
+void AliasTable::build(const std::vector<double> &weights)
+{
+    // Vose's algorithm: indices whose scaled weight is below 1 are
+    // completed by the ones above 1.
+    const size_t n = weights.size();
+    double total = 0.0;
+    for (double w : weights)
+        total += w;
+    prob.resize(n);
+    alias.resize(n);
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small, large;
+    for (size_t i = 0; i < n; ++i)
+    {
+        scaled[i] = weights[i] * n / total;
+        (scaled[i] < 1.0 ? small : large).push_back(uint32_t(i));
+    }
+    while (!small.empty() && !large.empty())
+    {
+        const uint32_t s = small.back(), l = large.back();
+        small.pop_back();
+        prob[s] = scaled[s];
+        alias[s] = l;
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0)
+        {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Remaining indices have a scaled weight of 1, up to rounding errors.
+    for (uint32_t i : small)
+        prob[i] = 1.0, alias[i] = i;
+    for (uint32_t i : large)
+        prob[i] = 1.0, alias[i] = i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// class ShapeArena
+///////////////////////////////////////////////////////////////////////////////
+
+static thread_local ShapeArena *current_arena = nullptr;
+
+ShapeArena::Scope::Scope(ShapeArena &arena)
+        : _previous(current_arena)
+{
+    current_arena = &arena;
+}
+
+ShapeArena::Scope::~Scope()
+{
+    current_arena = _previous;
+}
+
+ShapeArena::ShapeArena(size_t block_size)
+        : _ptr(nullptr), _end(nullptr), _block_size(block_size), _size(0) {}
+
+ShapeArena::~ShapeArena()
+{
+    for (char *b : _blocks)
+        ::operator delete(b);
+}
+
+void *ShapeArena::allocate(size_t size)
+{
+    size = (size + 15) & ~size_t(15);
+    if (size_t(_end - _ptr) < size)
+    {
+        // The rest of the last block is lost.
+        const size_t n = std::max(size, _block_size);
+        _blocks.push_back(static_cast<char *>(::operator new(n)));
+        _ptr = _blocks.back();
+        _end = _ptr + n;
+    }
+    void *p = _ptr;
+    _ptr += size;
+    _size += size;
+    return p;
+}
+
+ShapeArena *ShapeArena::current()
+{
+    return current_arena;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// class Primitive
+///////////////////////////////////////////////////////////////////////////////
+
+// Projects the primitive \a p on the unit axis \a n and returns the half
+// length of the projection.
+static qreal projectedRadius(const Primitive &p, const QPointF &n)
+{
+    if (p.kind == Primitive::DiskKind)
+        return p.hx;
+    const QPointF v(-p.u.y(), p.u.x());
+    return p.hx * ::fabs(QPointF::dotProduct(p.u, n)) + p.hy * ::fabs(QPointF::dotProduct(v, n));
+}
+
+bool Primitive::intersects(const Primitive &other) const
+{
+    // Bounding rectangles are compared with closed intervals, since
+    // touching shapes collide.
+    if (box.right() < other.box.left() || other.box.right() < box.left() ||
+        box.bottom() < other.box.top() || other.box.bottom() < box.top())
+        return false;
+    const QPointF d = other.c - c;
+    if (kind == DiskKind && other.kind == DiskKind)
+        return QPointF::dotProduct(d, d) <= (hx + other.hx) * (hx + other.hx);
+    if (kind == DiskKind || other.kind == DiskKind)
+    {
+        // Closest point of the box to the center of the disk.
+        const Primitive &b = kind == BoxKind ? *this : other;
+        const Primitive &r = kind == BoxKind ? other : *this;
+        const QPointF e = r.c - b.c;
+        const QPointF v(-b.u.y(), b.u.x());
+        const qreal x = QPointF::dotProduct(e, b.u);
+        const qreal y = QPointF::dotProduct(e, v);
+        const qreal dx = x - std::min(std::max(x, -b.hx), b.hx);
+        const qreal dy = y - std::min(std::max(y, -b.hy), b.hy);
+        return dx * dx + dy * dy <= r.hx * r.hx;
+    }
+    // Separating axis theorem: the sides of both boxes are the only
+    // candidate axes.
+    const QPointF axes[4] = {u, QPointF(-u.y(), u.x()),
+                             other.u, QPointF(-other.u.y(), other.u.x())};
+    for (const QPointF &n : axes)
+        if (::fabs(QPointF::dotProduct(d, n)) > projectedRadius(*this, n) + projectedRadius(other, n))
+            return false;
+    return true;
+}
+
+qreal Primitive::separation(const Primitive &other) const
+{
+    // The gap between bounding rectangles is cheap and often enough.
+    const qreal gap = std::max(std::max(other.box.left() - box.right(), box.left() - other.box.right()),
+                               std::max(other.box.top() - box.bottom(), box.top() - other.box.bottom()));
+    if (gap > 0.0)
+        return gap;
+    const QPointF d = other.c - c;
+    if (kind == DiskKind && other.kind == DiskKind)
+        return ::sqrt(QPointF::dotProduct(d, d)) - hx - other.hx;
+    if (kind == DiskKind || other.kind == DiskKind)
+    {
+        const Primitive &b = kind == BoxKind ? *this : other;
+        const Primitive &r = kind == BoxKind ? other : *this;
+        const QPointF e = r.c - b.c;
+        const QPointF v(-b.u.y(), b.u.x());
+        const qreal x = QPointF::dotProduct(e, b.u);
+        const qreal y = QPointF::dotProduct(e, v);
+        const qreal dx = x - std::min(std::max(x, -b.hx), b.hx);
+        const qreal dy = y - std::min(std::max(y, -b.hy), b.hy);
+        return ::sqrt(dx * dx + dy * dy) - r.hx;
+    }
+    // The gap along any unit axis is a lower bound of the distance.
+    const QPointF axes[4] = {u, QPointF(-u.y(), u.x()),
+                             other.u, QPointF(-other.u.y(), other.u.x())};
+    qreal sat = gap;
+    for (const QPointF &n : axes)
+        sat = std::max(sat, ::fabs(QPointF::dotProduct(d, n)) - projectedRadius(*this, n) - projectedRadius(other, n));
+    return sat;
+}
+
+QPointF Primitive::contactPoint(const Primitive &other) const
+{
+    const QPointF d = other.c - c;
+    if (kind == DiskKind && other.kind == DiskKind)
+    {
+        // Middle of the overlap of both disks along the line of centers.
+        const qreal l = ::sqrt(QPointF::dotProduct(d, d));
+        if (l == 0.0)
+            return c;
+        const qreal lo = std::max(-hx, l - other.hx), hi = std::min(hx, l + other.hx);
+        return c + d * (0.5 * (lo + hi) / l);
+    }
+    if (kind == DiskKind || other.kind == DiskKind)
+    {
+        // Closest point of the box to the center of the disk, kept off the
+        // sides of the box so that rounding does not leave it outside.
+        const Primitive &b = kind == BoxKind ? *this : other;
+        const Primitive &r = kind == BoxKind ? other : *this;
+        const QPointF e = r.c - b.c;
+        const QPointF v(-b.u.y(), b.u.x());
+        const qreal hx = b.hx * (1.0 - 1e-9), hy = b.hy * (1.0 - 1e-9);
+        const qreal x = std::min(std::max(QPointF::dotProduct(e, b.u), -hx), hx);
+        const qreal y = std::min(std::max(QPointF::dotProduct(e, v), -hy), hy);
+        return b.c + b.u * x + v * y;
+    }
+    // The corners of this box are clipped by the sides of the other one,
+    // and the intersection, which is convex, contains their centroid.
+    QPointF poly[8], clipped[8];
+    int n = 0;
+    const QPointF v(-u.y(), u.x());
+    for (int k = 0; k < 4; ++k)
+        poly[n++] = c + u * (k == 1 || k == 2 ? hx : -hx) + v * (k < 2 ? -hy : hy);
+    const QPointF ov(-other.u.y(), other.u.x());
+    const QPointF normals[4] = {other.u, -other.u, ov, -ov};
+    const qreal offsets[4] = {other.hx, other.hx, other.hy, other.hy};
+    for (int s = 0; s < 4 && n > 0; ++s)
+    {
+        int m = 0;
+        for (int k = 0; k < n; ++k)
+        {
+            const QPointF &p = poly[k], &q = poly[(k + 1) % n];
+            const qreal dp = QPointF::dotProduct(p - other.c, normals[s]) - offsets[s];
+            const qreal dq = QPointF::dotProduct(q - other.c, normals[s]) - offsets[s];
+            if (dp <= 0.0)
+                clipped[m++] = p;
+            if ((dp < 0.0) != (dq < 0.0) && dp != dq && m < 8)
+                clipped[m++] = p + (q - p) * (dp / (dp - dq));
+        }
+        std::copy(clipped, clipped + m, poly);
+        n = m;
+    }
+    if (n == 0)
+        return c + d * 0.5;
+    QPointF centroid(0.0, 0.0);
+    for (int k = 0; k < n; ++k)
+        centroid += poly[k];
+    return centroid / n;
+}
+
+bool GraphicalShape::primitives(const QTransform &, std::vector<Primitive> &) const
+{
+    return false;
+}
+
+// Each shape is preceded by a header giving the arena where it lives, or
+// 0 if it lives on the heap.
+static const size_t SHAPE_HEADER = 16;
+
+void *GraphicalShape::operator new(size_t size)
+{
+    ShapeArena *arena = ShapeArena::current();
+    char *p = static_cast<char *>(arena ? arena->allocate(size + SHAPE_HEADER)
+                                        : ::operator new(size + SHAPE_HEADER));
+    *reinterpret_cast<ShapeArena **>(p) = arena;
+    return p + SHAPE_HEADER;
+}
+
+void GraphicalShape::operator delete(void *p)
+{
+    if (!p)
+        return;
+    char *q = static_cast<char *>(p) - SHAPE_HEADER;
+    // Memory of arenas is released with them.
+    if (!*reinterpret_cast<ShapeArena **>(q))
+        ::operator delete(q);
+}
+
+GraphicalShape::GraphicalShape()
+        : _bounds_dirty(true) {}
+
+void GraphicalShape::invalidateBounds()
+{
+    // The shapes containing a shape with out of date bounds are out of
+    // date too, so that the first one stops the propagation: its scene
+    // has not read its bounds since they were last invalidated.
+    for (GraphicalShape *s = this; s != nullptr && !s->_bounds_dirty;
+         s = dynamic_cast<GraphicalShape *>(s->parentItem()))
+    {
+        s->prepareGeometryChange();
+        s->_bounds_dirty = true;
+    }
+}
+
+qreal GraphicalShape::area() const
+{
+    const QRectF r = boundingRect();
+    return r.width() * r.height();
+}
+
+void GraphicalShape::isInsideBatch(const float *xs, const float *ys, uint8_t *out, size_t n) const
+{
+    for (size_t i = 0; i < n; ++i)
+        out[i] = isInside(QPointF(xs[i], ys[i]));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Batch kernels
+///////////////////////////////////////////////////////////////////////////////
+
+// Points are processed by blocks of this size, so that intermediate
+// coordinates fit on the stack.
+static const size_t BATCH_BLOCK = 64;
+
+// Sets out[i] to 1 if the i-th point is in the disk of center (cx,cy)
+// and radius r, leaves it unchanged otherwise.
+static void batchDisk(const float *xs, const float *ys, float cx, float cy, float r,
+                      uint8_t *out, size_t n)
+{
+    const float r2 = r * r;
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256 vcx = _mm256_set1_ps(cx), vcy = _mm256_set1_ps(cy), vr2 = _mm256_set1_ps(r2);
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(xs + i), vcx);
+        const __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(ys + i), vcy);
+        const __m256 d2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        const int m = _mm256_movemask_ps(_mm256_cmp_ps(d2, vr2, _CMP_LE_OQ));
+        for (int k = 0; k < 8; ++k)
+            out[i + k] |= (m >> k) & 1;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128 wcx = _mm_set1_ps(cx), wcy = _mm_set1_ps(cy), wr2 = _mm_set1_ps(r2);
+    for (; i + 4 <= n; i += 4)
+    {
+        const __m128 dx = _mm_sub_ps(_mm_loadu_ps(xs + i), wcx);
+        const __m128 dy = _mm_sub_ps(_mm_loadu_ps(ys + i), wcy);
+        const __m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+        const int m = _mm_movemask_ps(_mm_cmple_ps(d2, wr2));
+        for (int k = 0; k < 4; ++k)
+            out[i + k] |= (m >> k) & 1;
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        const float dx = xs[i] - cx, dy = ys[i] - cy;
+        out[i] |= dx * dx + dy * dy <= r2;
+    }
+}
+
+// Sets out[i] to 1 if the i-th point is in the box of center (cx,cy),
+// of first axis (ux,uy) and of half sizes hx and hy, leaves it unchanged
+// otherwise.
+static void batchBox(const float *xs, const float *ys, float cx, float cy, float ux, float uy,
+                     float hx, float hy, uint8_t *out, size_t n)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256 vcx = _mm256_set1_ps(cx), vcy = _mm256_set1_ps(cy);
+    const __m256 vux = _mm256_set1_ps(ux), vuy = _mm256_set1_ps(uy);
+    const __m256 vhx = _mm256_set1_ps(hx), vhy = _mm256_set1_ps(hy);
+    const __m256 vabs = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(xs + i), vcx);
+        const __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(ys + i), vcy);
+        const __m256 a = _mm256_and_ps(_mm256_add_ps(_mm256_mul_ps(dx, vux), _mm256_mul_ps(dy, vuy)), vabs);
+        const __m256 b = _mm256_and_ps(_mm256_sub_ps(_mm256_mul_ps(dy, vux), _mm256_mul_ps(dx, vuy)), vabs);
+        const int m = _mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(a, vhx, _CMP_LE_OQ),
+                                                       _mm256_cmp_ps(b, vhy, _CMP_LE_OQ)));
+        for (int k = 0; k < 8; ++k)
+            out[i + k] |= (m >> k) & 1;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128 wcx = _mm_set1_ps(cx), wcy = _mm_set1_ps(cy);
+    const __m128 wux = _mm_set1_ps(ux), wuy = _mm_set1_ps(uy);
+    const __m128 whx = _mm_set1_ps(hx), why = _mm_set1_ps(hy);
+    const __m128 wabs = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    for (; i + 4 <= n; i += 4)
+    {
+        const __m128 dx = _mm_sub_ps(_mm_loadu_ps(xs + i), wcx);
+        const __m128 dy = _mm_sub_ps(_mm_loadu_ps(ys + i), wcy);
+        const __m128 a = _mm_and_ps(_mm_add_ps(_mm_mul_ps(dx, wux), _mm_mul_ps(dy, wuy)), wabs);
+        const __m128 b = _mm_and_ps(_mm_sub_ps(_mm_mul_ps(dy, wux), _mm_mul_ps(dx, wuy)), wabs);
+        const int m = _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(a, whx), _mm_cmple_ps(b, why)));
+        for (int k = 0; k < 4; ++k)
+            out[i + k] |= (m >> k) & 1;
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        const float dx = xs[i] - cx, dy = ys[i] - cy;
+        out[i] |= ::fabs(dx * ux + dy * uy) <= hx && ::fabs(dy * ux - dx * uy) <= hy;
+    }
+}
+
+// Maps n points by the inverse of the rigid transformation of
+// translation (dx,dy) and of angle a (in degrees), then tests them in
+// the shape f.
+static void batchInverse(const GraphicalShape *f, qreal dx, qreal dy, qreal a,
+                         const float *xs, const float *ys, uint8_t *out, size_t n)
+{
+    const float c = float(::cos(degreToRadian(a))), s = float(::sin(degreToRadian(a)));
+    const float tx = float(dx), ty = float(dy);
+    float lx[BATCH_BLOCK], ly[BATCH_BLOCK];
+    for (size_t b = 0; b < n; b += BATCH_BLOCK)
+    {
+        const size_t m = std::min(n - b, BATCH_BLOCK);
+        for (size_t i = 0; i < m; ++i)
+        {
+            const float x = xs[b + i] - tx, y = ys[b + i] - ty;
+            lx[i] = c * x + s * y;
+            ly[i] = c * y - s * x;
+        }
+        f->isInsideBatch(lx, ly, out + b, m);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// class CompiledShape
+///////////////////////////////////////////////////////////////////////////////
+
+CompiledShape::CompiledShape()
+        : exact(false), travel(0.0) {}
+
+void CompiledShape::compile(const GraphicalShape *f)
+{
+    static thread_local std::vector<Primitive> prims;
+    prims.clear();
+    const bool was_exact = exact;
+    exact = f->primitives(QTransform(), prims);
+    if (!exact)
+        prims.clear();
+    const size_t n = prims.size();
+    // Any point of a box moves by at most the move of its center plus
+    // the angle of rotation of its axes times its half perimeter.
+    if (!exact || (was_exact && n != size()))
+        travel = std::numeric_limits<qreal>::infinity();
+    else if (was_exact)
+    {
+        qreal move = 0.0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            const Primitive &p = prims[i];
+            qreal m = ::hypot(p.c.x() - cx[i], p.c.y() - cy[i]);
+            if (p.kind == Primitive::BoxKind)
+                m += (p.hx + p.hy) * 2.0 * ::asin(std::min(0.5 * ::hypot(p.u.x() - ux[i], p.u.y() - uy[i]), 1.0));
+            move = std::max(move, m);
+        }
+        travel += move;
+    }
+    kind.resize(n);
+    cx.resize(n);
+    cy.resize(n);
+    ux.resize(n);
+    uy.resize(n);
+    hx.resize(n);
+    hy.resize(n);
+    box.resize(n);
+    std::vector<double> areas(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        const Primitive &p = prims[i];
+        kind[i] = p.kind;
+        cx[i] = p.c.x();
+        cy[i] = p.c.y();
+        ux[i] = p.u.x();
+        uy[i] = p.u.y();
+        hx[i] = p.hx;
+        hy[i] = p.hy;
+        box[i] = p.box;
+        areas[i] = p.w;
+    }
+    table.build(areas);
+}
+
+Primitive
+CompiledShape::primitive(size_t i) const
+{
+    const qreal w = kind[i] == Primitive::DiskKind ? Pi * hx[i] * hx[i] : 4.0 * hx[i] * hy[i];
+    return Primitive{Primitive::Kind(kind[i]), QPointF(cx[i], cy[i]), QPointF(ux[i], uy[i]),
+                     hx[i], hy[i], box[i], w};
+}
+
+bool CompiledShape::isInside(const QPointF &p) const
+{
+    const qreal x = p.x(), y = p.y();
+    const size_t n = size();
+    for (size_t i = 0; i < n; ++i)
+    {
+        const qreal dx = x - cx[i], dy = y - cy[i];
+        if (kind[i] == Primitive::DiskKind)
+        {
+            if (dx * dx + dy * dy <= hx[i] * hx[i])
+                return true;
+        }
+        else if (::fabs(dx * ux[i] + dy * uy[i]) <= hx[i] && ::fabs(dy * ux[i] - dx * uy[i]) <= hy[i])
+            return true;
+    }
+    return false;
+}
+
+void CompiledShape::isInsideBatch(const float *xs, const float *ys, uint8_t *out, size_t n,
+                                  const QPointF &origin) const
+{
+    std::fill(out, out + n, 0);
+    // Centers are moved to the origin in double precision.
+    for (size_t i = 0; i < size(); ++i)
+        if (kind[i] == Primitive::DiskKind)
+            batchDisk(xs, ys, cx[i] - origin.x(), cy[i] - origin.y(), hx[i], out, n);
+        else
+            batchBox(xs, ys, cx[i] - origin.x(), cy[i] - origin.y(), ux[i], uy[i], hx[i], hy[i], out, n);
+}
+
+QPointF
+CompiledShape::randomPoint(RandomStream &rng) const
+{
+    const size_t i = table.sample(rng);
+    qreal a, b;
+    if (kind[i] == Primitive::DiskKind)
+    {
+        do
+        {
+            a = rng.generateDouble() * 2.0 - 1.0;
+            b = rng.generateDouble() * 2.0 - 1.0;
+        } while (a * a + b * b > 1.0);
+        return QPointF(cx[i] + a * hx[i], cy[i] + b * hx[i]);
+    }
+    a = (rng.generateDouble() * 2.0 - 1.0) * hx[i];
+    b = (rng.generateDouble() * 2.0 - 1.0) * hy[i];
+    return QPointF(cx[i] + a * ux[i] - b * uy[i], cy[i] + a * uy[i] + b * ux[i]);
+}
+
+bool CompiledShape::intersects(const CompiledShape &other) const
+{
+    for (size_t i = 0; i < size(); ++i)
+    {
+        const Primitive a = primitive(i);
+        for (size_t j = 0; j < other.size(); ++j)
+            if (a.intersects(other.primitive(j)))
+                return true;
+    }
+    return false;
+}
+
+void CompiledShape::translate(const QPointF &d)
+{
+    for (size_t i = 0; i < size(); ++i)
+    {
+        cx[i] += d.x();
+        cy[i] += d.y();
+        box[i].translate(d);
+    }
+}
+
+void CompiledShape::interpolate(const CompiledShape &from, const CompiledShape &to, qreal t)
+{
+    exact = to.exact;
+    kind = to.kind;
+    hx = to.hx;
+    hy = to.hy;
+    cx.resize(size());
+    cy.resize(size());
+    ux.resize(size());
+    uy.resize(size());
+    box.resize(size());
+    for (size_t i = 0; i < size(); ++i)
+    {
+        cx[i] = from.cx[i] + t * (to.cx[i] - from.cx[i]);
+        cy[i] = from.cy[i] + t * (to.cy[i] - from.cy[i]);
+        // Normalized linear interpolation of the axes.
+        const qreal x = from.ux[i] + t * (to.ux[i] - from.ux[i]);
+        const qreal y = from.uy[i] + t * (to.uy[i] - from.uy[i]);
+        const qreal l = ::hypot(x, y);
+        ux[i] = x / l;
+        uy[i] = y / l;
+        const qreal r = hx[i], ex = kind[i] == Primitive::DiskKind ? r : hx[i] * ::fabs(ux[i]) + hy[i] * ::fabs(uy[i]);
+        const qreal ey = kind[i] == Primitive::DiskKind ? r : hx[i] * ::fabs(uy[i]) + hy[i] * ::fabs(ux[i]);
+        box[i] = QRectF(cx[i] - ex, cy[i] - ey, 2.0 * ex, 2.0 * ey);
+    }
+}
+
+qreal CompiledShape::sweepSpeed(const CompiledShape &from, const World &world) const
+{
+    const qreal inf = std::numeric_limits<qreal>::infinity();
+    if (!exact || !from.exact || from.size() != size())
+        return inf;
+    qreal speed = 0.0;
+    for (size_t i = 0; i < size(); ++i)
+    {
+        const QPointF d(cx[i] - from.cx[i], cy[i] - from.cy[i]);
+        // Shapes wrapped around the world jump instead of moving.
+        if (world.delta(d) != d)
+            return inf;
+        qreal v = ::hypot(d.x(), d.y());
+        if (kind[i] == Primitive::BoxKind)
+        {
+            // The axes turn by an angle a, at an angular speed of at most
+            // 2 tan(a/2) when normalized from a linear interpolation.
+            const qreal c = ux[i] * from.ux[i] + uy[i] * from.uy[i];
+            if (c <= 0.0)
+                return inf;
+            const qreal a = ::acos(std::min(c, qreal(1.0)));
+            v += (hx[i] + hy[i]) * 2.0 * ::tan(0.5 * a);
+        }
+        speed = std::max(speed, v);
+    }
+    return speed;
+}
+
+qreal CompiledShape::separation(const CompiledShape &other, size_t &i, size_t &j) const
+{
+    qreal gap = std::numeric_limits<qreal>::infinity();
+    size_t closest_i = 0, closest_j = 0;
+    for (i = 0; i < size(); ++i)
+    {
+        const Primitive a = primitive(i);
+        for (j = 0; j < other.size(); ++j)
+        {
+            const Primitive b = other.primitive(j);
+            if (a.intersects(b))
+                return 0.0;
+            const qreal g = a.separation(b);
+            if (g < gap)
+                gap = g, closest_i = i, closest_j = j;
+        }
+    }
+    i = closest_i;
+    j = closest_j;
+    return std::max(gap, qreal(0.0));
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // class Disk
 ///////////////////////////////////////////////////////////////////////////////
@@ -32,28 +680,47 @@ Disk::Disk(qreal r, const MasterShape *master_shape)
         : _r(r), _master_shape(master_shape) {}
 
 QPointF
-Disk::randomPoint() const
+Disk::randomPoint(RandomStream &rng) const
 {
     QPointF p;
     do
     {
-        p = QPointF((RG.generateDouble() * 2.0 - 1.0),
-                                (RG.generateDouble() * 2.0 - 1.0));
+        p = QPointF((rng.generateDouble() * 2.0 - 1.0),
+                                (rng.generateDouble() * 2.0 - 1.0));
     } while ((p.x() * p.x() + p.y() * p.y()) > 1.0);
     return p * _r;
 }
 
+qreal Disk::area() const
+{
+    return Pi * _r * _r;
+}
+
 bool Disk::isInside(const QPointF &p) const
 {
     return QPointF::dotProduct(p, p) <= _r * _r;
 }
 
+void Disk::isInsideBatch(const float *xs, const float *ys, uint8_t *out, size_t n) const
+{
+    std::fill(out, out + n, 0);
+    batchDisk(xs, ys, 0.f, 0.f, _r, out, n);
+}
+
 QRectF
 Disk::boundingRect() const
 {
     return QRectF(-_r, -_r, 2.0 * _r, 2.0 * _r);
 }
 
+bool Disk::primitives(const QTransform &t, std::vector<Primitive> &out) const
+{
+    const QPointF c = t.map(QPointF(0.0, 0.0));
+    out.push_back(Primitive{Primitive::DiskKind, c, QPointF(t.m11(), t.m12()), _r, _r,
+                            QRectF(c.x() - _r, c.y() - _r, 2.0 * _r, 2.0 * _r), area()});
+    return true;
+}
+
 void Disk::paint(QPainter *painter, const QStyleOptionGraphicsItem *, QWidget *)
 {
     painter->setBrush(_master_shape->currentColor());
@@ -66,10 +733,15 @@ Rectangle::Rectangle(QPointF upLeft, QPointF downRight, const MasterShape *maste
         : _ul(upLeft), _dr(downRight), _master_shape(master_shape) {}
 
 QPointF
-Rectangle::randomPoint() const
+Rectangle::randomPoint(RandomStream &rng) const
+{
+    return QPointF(rng.generateDouble() * (_dr.x() - _ul.x()) + _ul.x(),
+                                 rng.generateDouble() * (_dr.y() - _ul.y()) + _ul.y());
+}
+
+qreal Rectangle::area() const
 {
-    return QPointF(RG.generateDouble() * (_dr.x() - _ul.x()) + _ul.x(),
-                                 RG.generateDouble() * (_dr.y() - _ul.y()) + _ul.y());
+    return (_dr.x() - _ul.x()) * (_dr.y() - _ul.y());
 }
 
 bool Rectangle::isInside(const QPointF &p) const
@@ -77,12 +749,32 @@ bool Rectangle::isInside(const QPointF &p) const
     return (p.x() >= _ul.x()) && (p.x() <= _dr.x()) && (p.y() >= _ul.y()) && (p.y() <= _dr.y());
 }
 
+void Rectangle::isInsideBatch(const float *xs, const float *ys, uint8_t *out, size_t n) const
+{
+    std::fill(out, out + n, 0);
+    batchBox(xs, ys, (_ul.x() + _dr.x()) / 2.0, (_ul.y() + _dr.y()) / 2.0, 1.f, 0.f,
+             (_dr.x() - _ul.x()) / 2.0, (_dr.y() - _ul.y()) / 2.0, out, n);
+}
+
 QRectF
 Rectangle::boundingRect() const
 {
     return QRectF(_ul, _dr);
 }
 
+bool Rectangle::primitives(const QTransform &t, std::vector<Primitive> &out) const
+{
+    const QPointF c = t.map((_ul + _dr) / 2.0);
+    const QPointF u(t.m11(), t.m12());
+    const qreal hx = (_dr.x() - _ul.x()) / 2.0;
+    const qreal hy = (_dr.y() - _ul.y()) / 2.0;
+    const qreal ex = ::fabs(u.x()) * hx + ::fabs(u.y()) * hy;
+    const qreal ey = ::fabs(u.y()) * hx + ::fabs(u.x()) * hy;
+    out.push_back(Primitive{Primitive::BoxKind, c, u, hx, hy,
+                            QRectF(c.x() - ex, c.y() - ey, 2.0 * ex, 2.0 * ey), area()});
+    return true;
+}
+
 void Rectangle::paint(QPainter *painter, const QStyleOptionGraphicsItem *, QWidget *)
 {
     painter->setBrush(_master_shape->currentColor());
@@ -94,20 +786,36 @@ void Rectangle::paint(QPainter *painter, const QStyleOptionGraphicsItem *, QWidg
 ///////////////////////////////////////////////////////////////////////////////
 
 Union::Union(GraphicalShape *s1, GraphicalShape *s2)
-        : _s1(s1), _s2(s2), _state()
+        : _s1(s1), _s2(s2)
 {
     _s1->setParentItem(this);
     _s2->setParentItem(this);
+    // Nested unions share the coordinates of this union, so their
+    // leaves are drawn directly.
+    for (const GraphicalShape *s : {_s1, _s2})
+        if (auto u = dynamic_cast<const Union *>(s))
+            _leaves.insert(_leaves.end(), u->_leaves.begin(), u->_leaves.end());
+        else
+            _leaves.push_back(s);
+    std::vector<double> areas;
+    for (const GraphicalShape *s : _leaves)
+        areas.push_back(s->area());
+    _table.build(areas);
 }
 
 Union::Union()
-        : _s1(nullptr), _s2(nullptr), _state() {}
+        : _s1(nullptr), _s2(nullptr) {}
 
 QPointF
-Union::randomPoint() const
+Union::randomPoint(RandomStream &rng) const
 {
-    _state = !_state;
-    return _state ? _s1->randomPoint() : _s2->randomPoint();
+    return _leaves[_table.sample(rng)]->randomPoint(rng);
+}
+
+qreal Union::area() const
+{
+    // Overlaps of the sub-shapes are counted twice.
+    return _s1->area() + _s2->area();
 }
 
 bool Union::isInside(const QPointF &p) const
@@ -115,10 +823,33 @@ bool Union::isInside(const QPointF &p) const
     return _s1->isInside(p) || _s2->isInside(p);
 }
 
+void Union::isInsideBatch(const float *xs, const float *ys, uint8_t *out, size_t n) const
+{
+    uint8_t in2[BATCH_BLOCK];
+    for (size_t b = 0; b < n; b += BATCH_BLOCK)
+    {
+        const size_t m = std::min(n - b, BATCH_BLOCK);
+        _s1->isInsideBatch(xs + b, ys + b, out + b, m);
+        _s2->isInsideBatch(xs + b, ys + b, in2, m);
+        for (size_t i = 0; i < m; ++i)
+            out[b + i] |= in2[i];
+    }
+}
+
 QRectF
 Union::boundingRect() const
 {
-    return _s1->boundingRect() | _s2->boundingRect();
+    if (_bounds_dirty)
+    {
+        _bounds = _s1->boundingRect() | _s2->boundingRect();
+        _bounds_dirty = false;
+    }
+    return _bounds;
+}
+
+bool Union::primitives(const QTransform &t, std::vector<Primitive> &out) const
+{
+    return _s1->primitives(t, out) && _s2->primitives(t, out);
 }
 
 void Union::paint(QPainter *painter, const QStyleOptionGraphicsItem *s, QWidget *w)
@@ -130,11 +861,6 @@ void Union::paint(QPainter *painter, const QStyleOptionGraphicsItem *s, QWidget
 // class Transformation
 ///////////////////////////////////////////////////////////////////////////////
 
-double degreToRadian(double angle)
-{
-    return angle * Pi / 180;
-}
-
 Transformation::Transformation(GraphicalShape *f, QPointF dx, qreal angle)
         : _f(f), _dx(dx), _a(angle)
 {
@@ -144,13 +870,18 @@ Transformation::Transformation(GraphicalShape *f, QPointF dx, qreal angle)
 }
 
 QPointF
-Transformation::randomPoint() const
+Transformation::randomPoint(RandomStream &rng) const
 {
-    QPointF rp = _f->randomPoint();
+    QPointF rp = _f->randomPoint(rng);
     double radA = degreToRadian(_a);
     return QPointF(rp.x() * ::cos(radA) - rp.y() * ::sin(radA), rp.y() * ::cos(radA) + rp.x() * ::sin(radA)) + _dx;
 }
 
+qreal Transformation::area() const
+{
+    return _f->area();
+}
+
 bool Transformation::isInside(const QPointF &p) const
 {
     QPointF untP = p - _dx;
@@ -161,16 +892,35 @@ bool Transformation::isInside(const QPointF &p) const
                     untP.y() * ::cos(-radA) + untP.x() * ::sin(-radA)));
 }
 
+void Transformation::isInsideBatch(const float *xs, const float *ys, uint8_t *out, size_t n) const
+{
+    batchInverse(_f, _dx.x(), _dx.y(), _a, xs, ys, out, n);
+}
+
 QRectF
 Transformation::boundingRect() const
 {
-    return mapRectToParent(_f->boundingRect());
+    if (_bounds_dirty)
+    {
+        _bounds = mapRectToParent(_f->boundingRect());
+        _bounds_dirty = false;
+    }
+    return _bounds;
+}
+
+bool Transformation::primitives(const QTransform &t, std::vector<Primitive> &out) const
+{
+    return _f->primitives(QTransform().translate(_dx.x(), _dx.y()).rotate(_a) * t, out);
 }
 
 void Transformation::setAngle(double a)
 {
+    // The shapes containing this one are told before their bounds change.
+    invalidateBounds();
     setRotation(a);
     _a = a;
+    if (auto master = dynamic_cast<MasterShape *>(topLevelItem()))
+        master->invalidate();
 }
 
 void Transformation::paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *w)
@@ -182,71 +932,224 @@ void Transformation::paint(QPainter *painter, const QStyleOptionGraphicsItem *op
 // ImageShape
 ///////////////////////////////////////////////////////////////////////////////
 
+ImageMask::ImageMask(const QPixmap &pixmap)
+        : bitmap(pixmap.mask())
+{
+    const QImage mask_img = bitmap.toImage().convertToFormat(QImage::Format_Mono);
+    width = mask_img.width();
+    height = mask_img.height();
+    words = (width + 63) / 64;
+    bits.assign(size_t(words) * height, 0);
+    for (int y = 0; y < height; ++y)
+    {
+        // Format_Mono stores the first pixel in the most significant bit.
+        const uchar *line = mask_img.constScanLine(y);
+        for (int x = 0; x < width; ++x)
+            if ((line[x >> 3] >> (7 - (x & 7))) & 1)
+            {
+                bits[size_t(y) * words + (x >> 6)] |= uint64_t(1) << (x & 63);
+                pixels.push_back(uint32_t(y) * width + x);
+                bbox = bbox.united(QRect(x, y, 1, 1));
+            }
+    }
+}
+
+/// @return the object of type T built from \a pixmap, shared by pixmap
+/// (QPixmap::cacheKey), and freed with the last shape using it.
+template <typename T>
+static std::shared_ptr<T> sharedByPixmap(const QPixmap &pixmap)
+{
+    static std::mutex mutex;
+    static std::map<qint64, std::weak_ptr<T>> cache;
+    std::lock_guard<std::mutex> lock(mutex);
+    // Objects of pixmaps that are no longer used are forgotten.
+    for (auto it = cache.begin(); it != cache.end();)
+        it = it->second.expired() ? cache.erase(it) : std::next(it);
+    std::weak_ptr<T> &entry = cache[pixmap.cacheKey()];
+    std::shared_ptr<T> object = entry.lock();
+    if (!object)
+    {
+        object = std::make_shared<T>(pixmap);
+        entry = object;
+    }
+    return object;
+}
+
+std::shared_ptr<const ImageMask>
+ImageMask::get(const QPixmap &pixmap)
+{
+    return sharedByPixmap<const ImageMask>(pixmap);
+}
+
 ImageShape::ImageShape(const QPixmap &pixmap, const MasterShape *master_shape)
-        : _pixmap(pixmap), _master_shape(master_shape)
+        : _pixmap(pixmap), _mask(ImageMask::get(pixmap)), _atlas(SpriteAtlas::get(pixmap)),
+          _master_shape(master_shape)
 {
-    _mask = _pixmap.mask();
-    _mask_img = QImage(_mask.toImage().convertToFormat(QImage::Format_Mono));
+    // Rigid transformations paint the closest frame of the atlas, rotated
+    // about the top left corner of the pixmap by up to STEP/2 degrees
+    // from the actual angle. A pixel at distance r of this corner moves by
+    // at most 2*r*sin(STEP/4) <= r*2*sin(STEP/2).
+    const QRectF box(_mask->bbox);
+    qreal r = 0.0;
+    for (const QPointF &c : {box.topLeft(), box.topRight(), box.bottomLeft(), box.bottomRight()})
+        r = std::max(r, ::hypot(c.x(), c.y()));
+    _margin = 1.0 + r * 2.0 * ::sin(SpriteAtlas::STEP * Pi / 360.0);
 }
 
 QPointF
-ImageShape::randomPoint() const
+ImageShape::randomPoint(RandomStream &rng) const
 {
-    int x, y;
-    do
-    {
-        x = _mask_img.width() * RG.generateDouble();
-        y = _mask_img.height() * RG.generateDouble();
-    } while (_mask_img.pixelIndex(x, y) == 0);
-    return QPointF(x, y);
+    assert(!_mask->pixels.empty());
+    const uint32_t i = _mask->pixels[rng.bounded(uint32_t(_mask->pixels.size()))];
+    return QPointF(i % _mask->width, i / _mask->width);
+}
+
+qreal ImageShape::area() const
+{
+    return qreal(_mask->pixels.size());
 }
 
 bool ImageShape::isInside(const QPointF &p) const
 {
+    // Coordinates are truncated, as QImage::valid and QImage::pixelIndex do.
+    return _mask->contains(int(p.x()), int(p.y()));
+}
 
-    return _mask_img.valid(p.x(), p.y()) && _mask_img.pixelIndex(p.x(), p.y()) != 0;
+void ImageShape::isInsideBatch(const float *xs, const float *ys, uint8_t *out, size_t n) const
+{
+    for (size_t i = 0; i < n; ++i)
+        out[i] = _mask->contains(int(xs[i]), int(ys[i]));
 }
 
 QRectF
 ImageShape::boundingRect() const
 {
-    return QRectF(QPointF(0,0), _pixmap.size());
+    return QRectF(_mask->bbox).adjusted(-_margin, -_margin, _margin, _margin);
 }
 
 void ImageShape::paint(QPainter *painter, const QStyleOptionGraphicsItem *, QWidget *)
 {
+    const QTransform t = painter->worldTransform();
+    const bool collision = _master_shape->currentState() == MasterShape::Collision;
+    // Rotations and translations only, i.e. orthonormal transformations
+    // that keep the orientation.
+    const bool rigid = t.type() <= QTransform::TxRotate
+            && ::fabs(t.m11() * t.m11() + t.m12() * t.m12() - 1.0) < 1e-6
+            && ::fabs(t.m11() - t.m22()) < 1e-6 && ::fabs(t.m12() + t.m21()) < 1e-6;
+    if (rigid)
+    {
+        // Rigid transformations snap to the closest pre-rotated frame,
+        // which is drawn without any transformation.
+        const qreal a = ::atan2(t.m12(), t.m11()) * 180.0 / Pi;
+        const SpriteAtlas::Frame &frame = _atlas->frame(a, collision ? _master_shape->currentColor() : QColor());
+        painter->save();
+        painter->setWorldTransform(QTransform::fromTranslate(t.dx(), t.dy()));
+        painter->drawPixmap(frame.offset, frame.pixmap);
+        painter->restore();
+        return;
+    }
     painter->drawPixmap(QPointF(0.0, 0.0), _pixmap);
     if (_master_shape->currentState() == MasterShape::Collision)
     {
         painter->setOpacity(0.5);
         painter->setBackgroundMode(Qt::TransparentMode);
         painter->setPen(_master_shape->currentColor());
-        painter->drawPixmap(QPointF(0.0, 0.0), _mask);
+        painter->drawPixmap(QPointF(0.0, 0.0), _mask->bitmap);
     }
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// class NiceAsteroid
+// class SpriteAtlas
 ///////////////////////////////////////////////////////////////////////////////
 
-NiceAsteroid::NiceAsteroid(QColor cok, QColor cko, double speed, QPixmap& asteroid_pixmap)
-        : MasterShape(cok, cko), _speed(speed)
+SpriteAtlas::SpriteAtlas(const QPixmap &pixmap)
+        : _pixmap(pixmap) {}
+
+const SpriteAtlas::Frame &
+SpriteAtlas::frame(qreal a, const QColor &tint)
 {
-    ImageShape* i = new ImageShape(asteroid_pixmap, this);
-    // transformation
-    Transformation* t1 = new Transformation(i, QPointF(IMAGE_SIZE / 2., IMAGE_SIZE / 2.), 0);
-    Transformation* t2 = new Transformation(t1, QPointF(0, 0), 10.);
+    const int nb_frames = 360 / STEP;
+    const int k = ((int(::floor(a / STEP + 0.5)) % nb_frames) + nb_frames) % nb_frames;
+    std::vector<Frame> &frames = _frames[std::make_pair(tint.isValid(), tint.isValid() ? tint.rgba() : 0)];
+    frames.resize(nb_frames);
+    Frame &f = frames[k];
+    if (!f.pixmap.isNull())
+        return f;
+    if (tint.isValid())
+    {
+        // Collisions cover the image by its color at half opacity.
+        const Frame &plain = frame(k * STEP);
+        QImage image = plain.pixmap.toImage().convertToFormat(QImage::Format_ARGB32_Premultiplied);
+        QPainter painter(&image);
+        painter.setCompositionMode(QPainter::CompositionMode_SourceAtop);
+        painter.setOpacity(0.5);
+        painter.fillRect(QRectF(0, 0, image.width(), image.height()), tint);
+        painter.end();
+        f.pixmap = QPixmap::fromImage(image);
+        f.offset = plain.offset;
+        return f;
+    }
+    QTransform r;
+    r.rotate(k * STEP);
+    f.pixmap = _pixmap.transformed(r, Qt::SmoothTransformation);
+    // QPixmap::transformed moves the result to the origin.
+    f.offset = -QPixmap::trueMatrix(r, _pixmap.width(), _pixmap.height()).map(QPointF(0.0, 0.0));
+    return f;
+}
+
+std::shared_ptr<SpriteAtlas>
+SpriteAtlas::get(const QPixmap &pixmap)
+{
+    return sharedByPixmap<SpriteAtlas>(pixmap);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// class NiceAsteroid
+///////////////////////////////////////////////////////////////////////////////
+
+NiceAsteroid::NiceAsteroid(QColor cok, QColor cko, double speed, QPixmap& asteroid_pixmap)
+        : MasterShape(cok, cko), _speed(speed)
+{
+    ImageShape* i = new ImageShape(asteroid_pixmap, this);
+    // transformation
+    Transformation* t1 = new Transformation(i, QPointF(IMAGE_SIZE / 2., IMAGE_SIZE / 2.), 0);
+    Transformation* t2 = new Transformation(t1, QPointF(0, 0), 10.);
     this->setGraphicalShape(t2);
     _t=t2;
 }
 
+ShapeSnapshot
+NiceAsteroid::snapshot() const
+{
+    ShapeSnapshot s = MasterShape::snapshot();
+    s.angle = _t->_a;
+    return s;
+}
+
+void NiceAsteroid::restore(const ShapeSnapshot &s)
+{
+    MasterShape::restore(s);
+    if (_t->_a != s.angle)
+        _t->setAngle(s.angle);
+}
+
+ShapeRecord
+NiceAsteroid::record() const
+{
+    ShapeRecord r = MasterShape::record();
+    r.kind = ShapeRecord::NiceAsteroidKind;
+    r.angle = _t->_a;
+    r.speed = _speed;
+    return r;
+}
+
 void NiceAsteroid::advance(int step)
 {
     if (!step)
         return;
     setPos(mapToParent(_speed, 0.0));
-//    setRotation(rotation() + RG.generateDouble() * _speed / 10. - _speed / 20.);
-    _t->setAngle(_t->_a + RG.generateDouble() * _speed / 10. - _speed / 20.);
+//    setRotation(rotation() + _rng.generateDouble() * _speed / 10. - _speed / 20.);
+    _t->setAngle(_t->_a + _rng.generateDouble() * _speed / 10. - _speed / 20.);
     MasterShape::advance(step);
 }
 
@@ -255,8 +1158,10 @@ void NiceAsteroid::advance(int step)
 ///////////////////////////////////////////////////////////////////////////////
 
 MasterShape::MasterShape(QColor cok, QColor cko)
-        : _f(0), _state(Ok), _cok(cok), _cko(cko)
+        : _id(-1), _f(0), _state(Ok), _cok(cok), _cko(cko), _dirty(true)
 {
+    // Moves are notified to itemChange.
+    setFlag(ItemSendsGeometryChanges);
 }
 
 void MasterShape::setGraphicalShape(GraphicalShape *f)
@@ -264,6 +1169,32 @@ void MasterShape::setGraphicalShape(GraphicalShape *f)
     _f = f;
     if (_f != 0)
         _f->setParentItem(this);
+    invalidate();
+}
+
+const CompiledShape &
+MasterShape::compiled() const
+{
+    if (_dirty && _f != 0)
+    {
+        _compiled.compile(this);
+        _dirty = false;
+    }
+    return _compiled;
+}
+
+void MasterShape::invalidate()
+{
+    _dirty = true;
+    invalidateBounds();
+}
+
+QVariant
+MasterShape::itemChange(GraphicsItemChange change, const QVariant &value)
+{
+    if (change == ItemPositionHasChanged || change == ItemRotationHasChanged)
+        invalidate();
+    return GraphicalShape::itemChange(change, value);
 }
 
 QColor
@@ -281,72 +1212,148 @@ MasterShape::currentState() const
     return _state;
 }
 
+void MasterShape::setCurrentState(State s)
+{
+    // The color of the shape changes with its state.
+    if (_state == s)
+        return;
+    _state = s;
+    update();
+}
+
 void MasterShape::paint(QPainter *, const QStyleOptionGraphicsItem *, QWidget *)
 {
     // nothing to do, Qt automatically calls paint of every QGraphicsItem
 }
 
-void MasterShape::advance(int step)
+ShapeSnapshot
+MasterShape::snapshot() const
 {
-    if (!step)
-        return;
+    return ShapeSnapshot{pos(), rotation(), 0.0, _state};
+}
 
-    // (I) Garde les objets dans la scene.
-    auto p = scenePos(); // pareil que pos si MasterShape est bien à la racine.
-    // pos() est dans les coordonnées parent et setPos aussi.
-    if (p.x() < -SZ_BD)
-    {
-        auto point = parentItem() != 0
-                                         ? parentItem()->mapFromScene(QPointF(IMAGE_SIZE + SZ_BD - 1, p.y()))
-                                         : QPointF(IMAGE_SIZE + SZ_BD - 1, p.y());
-        setPos(point);
-    }
-    else if (p.x() > IMAGE_SIZE + SZ_BD)
-    {
-        auto point = parentItem() != 0
-                                         ? parentItem()->mapFromScene(QPointF(-SZ_BD + 1, p.y()))
-                                         : QPointF(-SZ_BD + 1, p.y());
-        setPos(point);
-    }
-    if (p.y() < -SZ_BD)
-    {
-        auto point = parentItem() != 0 ? parentItem()->mapFromScene(QPointF(p.x(), IMAGE_SIZE + SZ_BD - 1))
-                                                                     : QPointF(p.x(), IMAGE_SIZE + SZ_BD - 1);
-        setPos(point);
-    }
-    else if (p.y() > IMAGE_SIZE + SZ_BD)
+void MasterShape::restore(const ShapeSnapshot &s)
+{
+    setPos(s.pos);
+    setRotation(s.rotation);
+    setCurrentState(s.state);
+}
+
+ShapeRecord
+MasterShape::record() const
+{
+    ShapeRecord r;
+    std::fill(r.reserved, r.reserved + sizeof(r.reserved), 0);
+    r.kind = ShapeRecord::UnknownKind;
+    r.cok = _cok.rgba();
+    r.cko = _cko.rgba();
+    r.x = pos().x();
+    r.y = pos().y();
+    r.rotation = rotation();
+    r.angle = 0.0;
+    r.speed = 0.0;
+    r.radius = 0.0;
+    return r;
+}
+
+bool ShapeRecord::valid() const
+{
+    // Shapes live within the border of the world, which is at most
+    // MAX_WORLD_SIZE wide, and asteroids are smaller than half the
+    // period of the smallest world.
+    auto within = [](double v, double bound) { return std::isfinite(v) && ::fabs(v) <= bound; };
+    return known() && within(x, 2 * MAX_WORLD_SIZE) && within(y, 2 * MAX_WORLD_SIZE) &&
+           std::isfinite(rotation) && std::isfinite(angle) && within(speed, MAX_WORLD_SIZE) &&
+           (kind != AsteroidKind || (radius > 0.0 && radius <= MIN_WORLD_SIZE / 4));
+}
+
+MasterShape *MasterShape::fromRecord(const ShapeRecord &r, QPixmap &asteroid_pixmap)
+{
+    const QColor cok = QColor::fromRgba(r.cok), cko = QColor::fromRgba(r.cko);
+    MasterShape *f;
+    switch (r.kind)
     {
-        auto point = parentItem() != 0
-                                         ? parentItem()->mapFromScene(QPointF(p.x(), -SZ_BD + 1))
-                                         : QPointF(p.x(), -SZ_BD + 1);
-        setPos(point);
+    case ShapeRecord::AsteroidKind:
+        f = new Asteroid(cok, cko, r.speed, r.radius);
+        break;
+    case ShapeRecord::SpaceTruckKind:
+        f = new SpaceTruck(cok, cko, r.speed);
+        break;
+    case ShapeRecord::EnterpriseKind:
+        f = new Enterprise(cok, cko, r.speed);
+        break;
+    case ShapeRecord::NiceAsteroidKind:
+        f = new NiceAsteroid(cok, cko, r.speed, asteroid_pixmap);
+        break;
+    default:
+        return nullptr;
     }
+    f->restore(ShapeSnapshot{QPointF(r.x, r.y), r.rotation, r.angle, Ok});
+    return f;
+}
 
-    // (II) regarde les intersections avec les autres objets.
-    if (logical_scene->intersect(this))
-        _state = Collision;
-    else
-        _state = Ok;
+void MasterShape::advance(int step)
+{
+    if (!step)
+        return;
+
+    // (I) les objets sont ramenés dans le monde par LogicalScene::tick.
+    // (II) les intersections sont calculées par LogicalScene::step.
 }
 
 QPointF
-MasterShape::randomPoint() const
+MasterShape::randomPoint(RandomStream &rng) const
 {
     assert(_f != 0);
-    return mapToParent(_f->randomPoint());
+    const CompiledShape &c = compiled();
+    return c.exact ? c.randomPoint(rng) : mapToParent(_f->randomPoint(rng));
+}
+
+qreal MasterShape::area() const
+{
+    assert(_f != 0);
+    return _f->area();
 }
 
 bool MasterShape::isInside(const QPointF &p) const
 {
     assert(_f != 0);
-    return _f->isInside(mapFromParent(p));
+    const CompiledShape &c = compiled();
+    return c.exact ? c.isInside(p) : _f->isInside(mapFromParent(p));
+}
+
+void MasterShape::isInsideBatch(const float *xs, const float *ys, uint8_t *out, size_t n) const
+{
+    isInsideBatch(xs, ys, out, n, QPointF());
+}
+
+void MasterShape::isInsideBatch(const float *xs, const float *ys, uint8_t *out, size_t n,
+                                const QPointF &origin) const
+{
+    assert(_f != 0);
+    const CompiledShape &c = compiled();
+    if (c.exact)
+        c.isInsideBatch(xs, ys, out, n, origin);
+    else
+        batchInverse(_f, pos().x() - origin.x(), pos().y() - origin.y(), rotation(), xs, ys, out, n);
 }
 
 QRectF
 MasterShape::boundingRect() const
 {
     assert(_f != 0);
-    return mapRectToParent(_f->boundingRect());
+    if (_bounds_dirty)
+    {
+        _bounds = mapRectToParent(_f->boundingRect());
+        _bounds_dirty = false;
+    }
+    return _bounds;
+}
+
+bool MasterShape::primitives(const QTransform &t, std::vector<Primitive> &out) const
+{
+    assert(_f != 0);
+    return _f->primitives(QTransform().translate(pos().x(), pos().y()).rotate(rotation()) * t, out);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -354,7 +1361,7 @@ MasterShape::boundingRect() const
 ///////////////////////////////////////////////////////////////////////////////
 
 Asteroid::Asteroid(QColor cok, QColor cko, double speed, double r)
-        : MasterShape(cok, cko), _speed(speed)
+        : MasterShape(cok, cko), _speed(speed), _r(r)
 {
     // This shape is very simple : just a disk.
     Disk *d = new Disk(r, this);
@@ -362,6 +1369,16 @@ Asteroid::Asteroid(QColor cok, QColor cko, double speed, double r)
     this->setGraphicalShape(d);
 }
 
+ShapeRecord
+Asteroid::record() const
+{
+    ShapeRecord r = MasterShape::record();
+    r.kind = ShapeRecord::AsteroidKind;
+    r.speed = _speed;
+    r.radius = _r;
+    return r;
+}
+
 void Asteroid::advance(int step)
 {
     if (!step)
@@ -377,21 +1394,25 @@ void Asteroid::advance(int step)
 SpaceTruck::SpaceTruck(QColor cok, QColor cko, double speed)
         : MasterShape(cok, cko), _speed(speed)
 {
-    Rectangle *d1 = new Rectangle(QPointF(-80, -10), QPointF(0, 10), this);
-    Rectangle *d2 = new Rectangle(QPointF(10, -10), QPointF(30, 10), this);
-    Rectangle *d3 = new Rectangle(QPointF(0, -3), QPointF(10, 3), this);
-    Union *u23 = new Union(d2, d3);
-    Union *u = new Union(d1, u23);
-    // Tells the space truck that it is composed of the union of the previous shapes.
-    this->setGraphicalShape(u);
+    // Its shape is known at compile time (see SpaceTruck::Shape).
+    this->setGraphicalShape(new StaticShape<Shape>(this));
 }
+ShapeRecord
+SpaceTruck::record() const
+{
+    ShapeRecord r = MasterShape::record();
+    r.kind = ShapeRecord::SpaceTruckKind;
+    r.speed = _speed;
+    return r;
+}
+
 void SpaceTruck::advance(int step)
 {
     if (!step)
         return;
     setPos(mapToParent(_speed, 0.0));
     // setrotation with slow speed
-    setRotation(rotation() + RG.generateDouble() * _speed - _speed / 2);
+    setRotation(rotation() + _rng.generateDouble() * _speed - _speed / 2);
     MasterShape::advance(step);
 }
 
@@ -402,32 +1423,24 @@ void SpaceTruck::advance(int step)
 Enterprise::Enterprise(QColor cok, QColor cko, double speed)
         : MasterShape(cok, cko), _speed(speed)
 {
-    Rectangle *r1 = new Rectangle(QPointF(-100, -8), QPointF(0, 8), this);
-    Rectangle *r2 = new Rectangle(QPointF(-100, -8), QPointF(0, 8), this);
-    Rectangle *rb = new Rectangle(QPointF(-40, -9), QPointF(40, 9), this);
-    Rectangle *s1 = new Rectangle(QPointF(-25, -5), QPointF(25, 5), this);
-    Rectangle *s2 = new Rectangle(QPointF(-25, -5), QPointF(25, 5), this);
-    Disk *d = new Disk(40.0, this);
-    Transformation *t1 = new Transformation(r1, QPointF(0., 40.0));
-    Transformation *t2 = new Transformation(r2, QPointF(0., -40.0));
-    Transformation *td = new Transformation(d, QPointF(70., 0.0));
-    Transformation *ts1 = new Transformation(s1, QPointF(-30.0, 0.0), 0.0);
-    Transformation *us1 = new Transformation(ts1, QPointF(0.0, 0.0), 45.0);
-    Transformation *ts2 = new Transformation(s2, QPointF(-30.0, 0.0), 0.0);
-    Transformation *us2 = new Transformation(ts2, QPointF(0.0, 0.0), -45.0);
-    Union *back = new Union(t1, t2);
-    Union *head = new Union(rb, td);
-    Union *legs = new Union(us1, us2);
-    Union *body = new Union(legs, back);
-    Union *all = new Union(head, body);
-    this->setGraphicalShape(all);
+    // Its shape is known at compile time (see Enterprise::Shape).
+    this->setGraphicalShape(new StaticShape<Shape>(this));
 }
+ShapeRecord
+Enterprise::record() const
+{
+    ShapeRecord r = MasterShape::record();
+    r.kind = ShapeRecord::EnterpriseKind;
+    r.speed = _speed;
+    return r;
+}
+
 void Enterprise::advance(int step)
 {
     if (!step)
         return;
     setPos(mapToParent(_speed, 0.0));
-    setRotation(rotation() + RG.generateDouble() * _speed / 10. - _speed / 15.);
+    setRotation(rotation() + _rng.generateDouble() * _speed / 10. - _speed / 15.);
     MasterShape::advance(step);
 }
 
@@ -435,23 +1448,1116 @@ void Enterprise::advance(int step)
 // class LogicalScene
 ///////////////////////////////////////////////////////////////////////////////
 
-LogicalScene::LogicalScene(int n)
-        : nb_tested(n) {}
+LogicalScene::LogicalScene(int n, qreal cell)
+        : nb_tested(n), sampling(Adaptive), seed(1), cell_size(cell), instrumented(false), recorder(nullptr), continuous(false),
+          _min_cell_size(cell), _bucket_bits(0), _query(0), _tick(0),
+          _next_pair(0), _perf_out(nullptr), _perf_pending(false)
+{
+    setWorld(World());
+    setThreadCount(QThread::idealThreadCount());
+}
+
+LogicalScene::~LogicalScene()
+{
+    flushPerf();
+}
+
+void LogicalScene::setThreadCount(int n)
+{
+    nb_threads = std::max(n, 1);
+    // The calling thread takes its share of the work.
+    _pool.setMaxThreadCount(std::max(nb_threads - 1, 1));
+}
+
+// Largest number of buckets of the broad phase grid.
+static const int BUCKET_BITS = 16;
+static const size_t MAX_BUCKETS = size_t(1) << BUCKET_BITS;
+
+void LogicalScene::setWorld(const World &w)
+{
+    world = w;
+    // Cells tile a period of the world, so that a shape near a seam
+    // shares cells with its neighbours on the other side.
+    nb_cells = std::max(int(world.period() / _min_cell_size), 1);
+    cell_size = world.period() / nb_cells;
+    // One bucket per cell if the world is small, otherwise cells are
+    // hashed in MAX_BUCKETS buckets.
+    const size_t nb = size_t(nb_cells) * size_t(nb_cells);
+    _bucket_bits = nb > MAX_BUCKETS ? BUCKET_BITS : 0;
+    cells.assign(std::min(nb, MAX_BUCKETS), std::vector<int>());
+    for (auto f : formes)
+    {
+        proxies[f->_id].cells = QRect();
+        proxies[f->_id].last = QRectF();
+        update(f);
+    }
+}
+
+std::vector<int> &
+LogicalScene::bucket(int x, int y)
+{
+    x %= nb_cells;
+    y %= nb_cells;
+    if (!_bucket_bits)
+        return cells[size_t(y) * size_t(nb_cells) + size_t(x)];
+    // Fibonacci hashing of both coordinates, whose high bits are the
+    // best mixed.
+    const quint32 h = (quint32(x) * 0x9E3779B1u ^ quint32(y) * 0x85EBCA77u) * 0x9E3779B1u;
+    return cells[h >> (32 - _bucket_bits)];
+}
+
+QRect
+LogicalScene::cellRange(const QRectF &r) const
+{
+    // Ranges start in the first period of the grid and cover at most
+    // all of its cells once, whatever the coordinates of the rectangle.
+    auto cell = [this](qreal v) { return int(::floor((v + world.border) / cell_size)); };
+    const int x = cell(r.left()), y = cell(r.top());
+    const int w = std::min(cell(r.right()) - x, nb_cells - 1);
+    const int h = std::min(cell(r.bottom()) - y, nb_cells - 1);
+    const int x0 = (x % nb_cells + nb_cells) % nb_cells, y0 = (y % nb_cells + nb_cells) % nb_cells;
+    return QRect(QPoint(x0, y0), QPoint(x0 + w, y0 + h));
+}
+
+void LogicalScene::populate(const SceneParams &params, QPixmap &asteroid_pixmap)
+{
+    // The nodes of each shape are contiguous in the arena.
+    ShapeArena::Scope scope(arena);
+    QRandomGenerator rg(static_cast<quint32>(seed));
+    // Shapes are placed on a circle around the center of the world,
+    // scaled with it.
+    const qreal center = world.size / 2, radius = 200 * world.size / IMAGE_SIZE;
+    for (int i = 0; i < params.asteroids; ++i)
+    {
+        QColor cok(150, 130, 110);
+        QColor cko(255, 240, 0);
+
+        // A master shape gathers all the elements of the shape.
+        MasterShape *asteroid = new Asteroid(cok, cko,
+                                             rg.generateDouble() * 2 + 2 /* speed */,
+                                             10. + rg.generateDouble() * 40. /* radius */);
+        // Set direction and position
+        asteroid->setRotation(rg.generateDouble() * 360);
+        asteroid->setPos(center + ::sin((i * 6.28) / params.asteroids) * radius,
+                         center + ::cos((i * 6.28) / params.asteroids) * radius);
+        add(asteroid);
+    }
+
+    for (int i = 0; i < params.trucks; ++i)
+    {
+        QColor cok(0, 130, 0);
+        QColor cko(255, 240, 0);
+
+        MasterShape *spaceTruck = new SpaceTruck(cok, cko,
+                                                 rg.generateDouble() * 2. + 2. /* speed */);
+        spaceTruck->setRotation(rg.generateDouble() * 360.);
+        spaceTruck->setPos(center + ::sin((i * 6.28) / params.trucks) * radius,
+                           center + ::cos((i * 6.28) / params.trucks) * radius);
+        add(spaceTruck);
+    }
+
+    for (int i = 0; i < params.enterprises; ++i)
+    {
+        QColor cok(150, 0, 0);
+        QColor cko(255, 240, 0);
+
+        MasterShape *enterprise = new Enterprise(cok, cko,
+                                                 rg.generateDouble() * 2. + 1.);
+        enterprise->setPos(center, center);
+        add(enterprise);
+    }
+
+    for (int i = 0; i < params.nices; ++i)
+    {
+        QColor cok(150, 130, 110);
+        QColor cko(255, 240, 0);
+        MasterShape *nice_asteroid = new NiceAsteroid(cok, cko,
+                                                      rg.generateDouble() * 2. + 1. /* speed */,
+                                                      asteroid_pixmap);
+        nice_asteroid->setPos(center + ::sin((i * 6.28) / params.nices) * radius,
+                              center + ::cos((i * 6.28) / params.nices) * radius);
+        nice_asteroid->setRotation(rg.generateDouble() * 360.);
+        add(nice_asteroid);
+    }
+}
+
+// Header of scene files and of logs, followed by the records of the
+// shapes.
+struct SceneHeader
+{
+    char    magic[4]; // "COLS"
+    quint32 version;
+    quint64 count;
+    double  size;     // World::size
+    double  border;   // World::border
+};
+static const quint32 SCENE_VERSION = 2;
+static const quint32 LOG_VERSION = 3;
+static_assert(sizeof(SceneHeader) == 32, "headers of scene files have a fixed size");
+static_assert(sizeof(ShapeRecord) == 64, "records of scene files have a fixed size");
+
+bool LogicalScene::save(const QString &name) const
+{
+    SceneHeader header = {{'C', 'O', 'L', 'S'}, SCENE_VERSION, quint64(formes.size()), world.size, world.border};
+    std::vector<ShapeRecord> records;
+    records.reserve(formes.size());
+    for (auto f : formes)
+    {
+        records.push_back(f->record());
+        // Such a file could not be loaded.
+        if (!records.back().known())
+            return false;
+    }
+    QFile file(name);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+    const qint64 size = qint64(records.size() * sizeof(ShapeRecord));
+    return file.write(reinterpret_cast<const char *>(&header), sizeof(header)) == qint64(sizeof(header)) &&
+           file.write(reinterpret_cast<const char *>(records.data()), size) == size;
+}
+
+bool LogicalScene::load(const QString &name, QPixmap &asteroid_pixmap)
+{
+    QFile file(name);
+    if (!file.open(QIODevice::ReadOnly) || file.size() < qint64(sizeof(SceneHeader)))
+        return false;
+    const uchar *data = file.map(0, file.size());
+    if (!data)
+        return false;
+    SceneHeader header;
+    std::copy(data, data + sizeof(header), reinterpret_cast<uchar *>(&header));
+    bool valid = std::equal(header.magic, header.magic + 4, "COLS") && header.version == SCENE_VERSION &&
+                 header.count <= quint64(file.size() - sizeof(header)) / sizeof(ShapeRecord);
+    // The shapes are added to the world of the file, which can only
+    // replace the world of an empty scene.
+    const World file_world(header.size, header.border);
+    const bool same_world = file_world.size == world.size && file_world.border == world.border;
+    valid = valid && file_world.isValid() && (same_world || formes.empty());
+    const ShapeRecord *records = reinterpret_cast<const ShapeRecord *>(data + sizeof(header));
+    // Files with unknown kinds of shapes or invalid fields are rejected
+    // as a whole.
+    for (quint64 i = 0; valid && i < header.count; ++i)
+        valid = records[i].valid();
+    if (valid)
+    {
+        if (!same_world)
+            setWorld(file_world);
+        ShapeArena::Scope scope(arena);
+        formes.reserve(formes.size() + header.count);
+        proxies.reserve(proxies.size() + header.count);
+        for (quint64 i = 0; i < header.count; ++i)
+            add(MasterShape::fromRecord(records[i], asteroid_pixmap));
+    }
+    file.unmap(const_cast<uchar *>(data));
+    return valid;
+}
+
+void LogicalScene::add(MasterShape *f)
+{
+    assert(f->_id < 0);
+    f->_id = int(formes.size());
+    f->_rng = RandomStream(seed, quint64(f->_id));
+    formes.push_back(f);
+    proxies.push_back(Proxy{QRectF(), QRect(), _query, QRectF()});
+    update(f);
+    if (continuous)
+    {
+        _previous.resize(formes.size());
+        _previous[f->_id] = f->compiled();
+    }
+}
+
+void LogicalScene::update(MasterShape *f)
+{
+    if (f->_id < 0)
+        return;
+    Proxy &proxy = proxies[f->_id];
+    const QRectF box = f->boundingRect();
+    proxy.box = box;
+    // Continuous detection sweeps the rectangle since the last update,
+    // moved next to the current one if the shape has been wrapped.
+    if (continuous && !proxy.last.isNull())
+        proxy.box |= proxy.last.translated(world.offset(box.center(), proxy.last.center()));
+    proxy.last = box;
+    // Compiles the shape now, since the narrow phase may read it from
+    // several threads.
+    f->compiled();
+    QRect range = cellRange(proxy.box);
+    if (range == proxy.cells)
+        return;
+    // Removes the shape from the cells it has left...
+    for (int y = proxy.cells.top(); y <= proxy.cells.bottom(); ++y)
+        for (int x = proxy.cells.left(); x <= proxy.cells.right(); ++x)
+            if (!range.contains(QPoint(x, y)))
+            {
+                auto &cell = bucket(x, y);
+                auto it = std::find(cell.begin(), cell.end(), f->_id);
+                *it = cell.back();
+                cell.pop_back();
+            }
+    // ...and adds it to the cells it has entered.
+    for (int y = range.top(); y <= range.bottom(); ++y)
+        for (int x = range.left(); x <= range.right(); ++x)
+            if (!proxy.cells.contains(QPoint(x, y)))
+                bucket(x, y).push_back(f->_id);
+    proxy.cells = range;
+}
+
+void LogicalScene::candidates(const MasterShape *f1, std::vector<MasterShape *> &result)
+{
+    result.clear();
+    const QRectF box = f1->_id >= 0 ? proxies[f1->_id].box : f1->boundingRect();
+    const QRect range = cellRange(box);
+    // Each query has its own mark so that shapes spanning several
+    // cells are reported once.
+    ++_query;
+    for (int y = range.top(); y <= range.bottom(); ++y)
+        for (int x = range.left(); x <= range.right(); ++x)
+            for (int id : bucket(x, y))
+            {
+                Proxy &proxy = proxies[id];
+                if (proxy.mark == _query)
+                    continue;
+                proxy.mark = _query;
+                if (id != f1->_id && world.intersects(proxy.box, box))
+                    result.push_back(formes[id]);
+            }
+}
+
+RandomStream
+LogicalScene::pairStream(const MasterShape *f1, const MasterShape *f2) const
+{
+    // Streams of pairs are distinct from the ones of shapes (high bit).
+    const quint64 ids = (quint64(quint32(std::min(f1->_id, f2->_id))) << 32) | quint32(std::max(f1->_id, f2->_id));
+    uint64_t x = _tick;
+    return RandomStream(seed, (splitmix64(x) ^ ids) | (quint64(1) << 63));
+}
+
+QPointF LogicalScene::pairOffset(const MasterShape *f1, const MasterShape *f2) const
+{
+    // The broad phase pairs shapes by their rectangles, whose centers may
+    // be far from pos() (e.g. NiceAsteroid), so they choose the seam.
+    const QRectF b1 = f1->_id >= 0 ? proxies[f1->_id].box : f1->boundingRect();
+    const QRectF b2 = f2->_id >= 0 ? proxies[f2->_id].box : f2->boundingRect();
+    return world.offset(b1.center(), b2.center());
+}
 
 bool LogicalScene::intersect(MasterShape *f1, MasterShape *f2)
 {
-    for (int i = 0; i < nb_tested; ++i)
+    RandomStream rng = pairStream(f1, f2);
+    return intersect(f1, f2, rng);
+}
+
+// @return the compiled shape \a c, or a copy in \a scratch moved by \a d
+// if \a d is not null.
+static const CompiledShape &translated(const CompiledShape &c, const QPointF &d, CompiledShape &scratch)
+{
+    if (d.isNull())
+        return c;
+    scratch = c;
+    scratch.translate(d);
+    return scratch;
+}
+
+bool LogicalScene::intersect(MasterShape *f1, MasterShape *f2, RandomStream &rng)
+{
+    PerfCounters counters;
+    // Shapes made of disks and boxes are tested exactly, the second one
+    // being moved next to the first one across the seams of the world.
+    static thread_local CompiledShape moved;
+    const QPointF offset = pairOffset(f1, f2);
+    const CompiledShape &c1 = f1->compiled();
+    const CompiledShape &c2 = translated(f2->compiled(), offset, moved);
+    if (c1.exact && c2.exact)
+        return c1.intersects(c2);
+    // Otherwise (bitmaps), points are tested.
+    QPointF p;
+    return sampling == Adaptive ? intersectAdaptive(f1, f2, offset, rng, p, counters)
+                                : intersectUniform(f1, f2, offset, rng, p, counters);
+}
+
+bool LogicalScene::intersect(MasterShape *f1, MasterShape *f2, Witness &witness, PerfCounters &counters)
+{
+    // The second shape is seen next to the first one, which is the frame
+    // of the witness.
+    static thread_local CompiledShape moved;
+    const QPointF offset = pairOffset(f1, f2);
+    const CompiledShape &c1 = f1->compiled();
+    const CompiledShape &c2 = translated(f2->compiled(), offset, moved);
+    witness.toi = 1.0;
+    switch (witness.kind)
+    {
+    case Witness::Primitives:
+        // Colliding primitives usually still collide one tick later.
+        if (witness.i < c1.size() && witness.j < c2.size())
+        {
+            const Primitive a = c1.primitive(witness.i), b = c2.primitive(witness.j);
+            if (a.intersects(b))
+            {
+                ++counters.witness_hits;
+                witness.p = a.contactPoint(b);
+                return true;
+            }
+        }
+        break;
+    case Witness::Point:
+        counters.inside_tests += 2;
+        if (f1->isInside(witness.p) && f2->isInside(witness.p - offset))
+        {
+            ++counters.witness_hits;
+            return true;
+        }
+        break;
+    case Witness::Separated:
+        // No point of both shapes has moved enough to fill the gap.
+        if (c1.travel + c2.travel - witness.travel < witness.gap)
+        {
+            ++counters.witness_hits;
+            ++counters.culled;
+            return false;
+        }
+        break;
+    case Witness::None:
+        break;
+    }
+    if (c1.exact && c2.exact && continuous)
+    {
+        qreal gap;
+        if (sweep(f1, f2, offset, witness.toi, gap, witness.p))
+        {
+            witness.kind = Witness::None;
+            return true;
+        }
+        witness.kind = Witness::Separated;
+        witness.gap = gap;
+        witness.travel = c1.travel + c2.travel;
+        return false;
+    }
+    if (c1.exact && c2.exact)
+    {
+        size_t i, j;
+        const qreal gap = c1.separation(c2, i, j);
+        if (gap <= 0.0)
+        {
+            witness.kind = Witness::Primitives;
+            witness.i = quint32(i);
+            witness.j = quint32(j);
+            witness.p = c1.primitive(i).contactPoint(c2.primitive(j));
+            return true;
+        }
+        witness.kind = Witness::Separated;
+        witness.gap = gap;
+        witness.travel = c1.travel + c2.travel;
+        return false;
+    }
+    RandomStream rng = pairStream(f1, f2);
+    const bool result = sampling == Adaptive ? intersectAdaptive(f1, f2, offset, rng, witness.p, counters)
+                                             : intersectUniform(f1, f2, offset, rng, witness.p, counters);
+    witness.kind = result ? Witness::Point : Witness::None;
+    return result;
+}
+
+// Points are tested by blocks of this size, so that a collision is
+// detected without testing all points.
+static const int SAMPLE_BLOCK = 32;
+
+bool LogicalScene::intersectUniform(MasterShape *f1, MasterShape *f2, const QPointF &offset, RandomStream &rng,
+                                    QPointF &witness, PerfCounters &counters)
+{
+    // Points of f2 are moved next to f1 across the seams of the world.
+    // They are given relative to f1, which is at o2 in the frame of f2,
+    // so that they stay precise as floats far from the origin.
+    const QPointF o1 = f1->pos(), o2 = o1 - offset;
+    float xs[SAMPLE_BLOCK], ys[SAMPLE_BLOCK];
+    uint8_t in[SAMPLE_BLOCK];
+    for (int b = 0; b < nb_tested; b += SAMPLE_BLOCK)
+    {
+        const int n = std::min(nb_tested - b, SAMPLE_BLOCK);
+        for (MasterShape *f : {f1, f2})
+        {
+            MasterShape *other = f == f1 ? f2 : f1;
+            const QPointF d = f == f1 ? -o1 : offset - o1;
+            for (int i = 0; i < n; ++i)
+            {
+                const QPointF p = f->randomPoint(rng) + d;
+                xs[i] = p.x();
+                ys[i] = p.y();
+            }
+            other->isInsideBatch(xs, ys, in, n, f == f1 ? o2 : o1);
+            counters.random_points += n;
+            counters.inside_tests += n;
+            const uint8_t *it = std::find(in, in + n, 1);
+            if (it != in + n)
+            {
+                // The witness is in the frame of f1.
+                witness = QPointF(xs[it - in], ys[it - in]) + o1;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Radical inverse of i in the given base, i.e. the i-th element of the
+// van der Corput sequence of this base.
+static double radicalInverse(unsigned i, unsigned base)
+{
+    double r = 0.0, f = 1.0 / base;
+    for (; i != 0; i /= base, f /= base)
+        r += f * (i % base);
+    return r;
+}
+
+bool LogicalScene::intersectAdaptive(MasterShape *f1, MasterShape *f2, const QPointF &offset, RandomStream &rng,
+                                     QPointF &witness, PerfCounters &counters)
+{
+    // Points are taken next to f1, relative to its position o1 so that
+    // they stay precise as floats, and tested in f2 relative to the
+    // position o2 of f1 moved back across the seams of the world.
+    const QPointF o1 = f1->pos(), o2 = o1 - offset;
+    const QRectF b1 = f1->boundingRect();
+    const QRectF b2 = f2->boundingRect().translated(offset);
+    const QRectF inter = b1 & b2;
+    if (inter.isEmpty())
+        return false;
+    // Uniform tests nb_tested points of each shape, which fall in the
+    // other one with a probability of about overlap/area. As many hits
+    // are expected from points of the intersection, which are in both
+    // shapes with a probability of overlap/a, when there are
+    // nb_tested*a*(1/area1 + 1/area2) of them, but never more than the
+    // nb_tested points Uniform may test in each shape.
+    const qreal a = inter.width() * inter.height();
+    const qreal budget = nb_tested * a * (1.0 / f1->area() + 1.0 / f2->area());
+    const int n = std::max(int(::ceil(std::min(budget, qreal(nb_tested)))), 1);
+    // A random shift of the sequence (Cranley-Patterson rotation) keeps
+    // successive tests of the same pair independent.
+    const double u0 = rng.generateDouble(), v0 = rng.generateDouble();
+    float xs[SAMPLE_BLOCK], ys[SAMPLE_BLOCK];
+    uint8_t in[SAMPLE_BLOCK];
+    // Blocks grow from a few points, so that deep overlaps are found
+    // after a few tests, and only the points in f1 are tested in f2.
+    for (int b = 0, size = SAMPLE_BLOCK / 4; b < n; b += size, size = std::min(2 * size, SAMPLE_BLOCK))
     {
-        if (f2->isInside(f1->randomPoint()) || f1->isInside(f2->randomPoint()))
+        const int m = std::min(n - b, size);
+        for (int i = 0; i < m; ++i)
+        {
+            const double u = radicalInverse(b + i + 1, 2) + u0;
+            const double v = radicalInverse(b + i + 1, 3) + v0;
+            xs[i] = inter.left() - o1.x() + (u - ::floor(u)) * inter.width();
+            ys[i] = inter.top() - o1.y() + (v - ::floor(v)) * inter.height();
+        }
+        f1->isInsideBatch(xs, ys, in, m, o1);
+        int k = 0;
+        for (int i = 0; i < m; ++i)
+            if (in[i])
+            {
+                xs[k] = xs[i];
+                ys[k] = ys[i];
+                ++k;
+            }
+        f2->isInsideBatch(xs, ys, in, k, o2);
+        counters.inside_tests += m + k;
+        const uint8_t *it = std::find(in, in + k, 1);
+        if (it != in + k)
+        {
+            witness = QPointF(xs[it - in], ys[it - in]) + o1;
             return true;
+        }
     }
     return false;
 }
 
+// Distance under which swept shapes are said to collide, and maximal
+// number of steps of the conservative advancement.
+static const qreal SWEEP_TOLERANCE = 0.01;
+static const int SWEEP_STEPS = 64;
+
+bool LogicalScene::sweep(MasterShape *f1, MasterShape *f2, const QPointF &offset, qreal &toi, qreal &gap,
+                         QPointF &point) const
+{
+    // The second shape and its previous primitives are moved next to the
+    // first one across the seams of the world.
+    static thread_local CompiledShape moved, moved_previous;
+    const CompiledShape &c1 = f1->compiled();
+    const CompiledShape &c2 = translated(f2->compiled(), offset, moved);
+    const bool known = size_t(f1->_id) < _previous.size() && size_t(f2->_id) < _previous.size();
+    const CompiledShape &p1 = known ? _previous[f1->_id] : c1;
+    const CompiledShape &p2 = known ? translated(_previous[f2->_id], offset, moved_previous) : c2;
+    const qreal v1 = known ? c1.sweepSpeed(p1, world) : std::numeric_limits<qreal>::infinity();
+    const qreal v2 = known ? c2.sweepSpeed(p2, world) : std::numeric_limits<qreal>::infinity();
+    size_t i, j;
+    if (std::isinf(v1 + v2))
+    {
+        // Moves that cannot be interpolated are tested at their end.
+        gap = c1.separation(c2, i, j);
+        toi = 1.0;
+        if (gap > 0.0)
+            return false;
+        point = c1.primitive(i).contactPoint(c2.primitive(j));
+        return true;
+    }
+    // Conservative advancement: shapes at distance d cannot touch before
+    // d / (v1 + v2).
+    static thread_local CompiledShape s1, s2;
+    qreal t = 0.0;
+    for (int k = 0; k < SWEEP_STEPS; ++k)
+    {
+        s1.interpolate(p1, c1, t);
+        s2.interpolate(p2, c2, t);
+        gap = s1.separation(s2, i, j);
+        if (gap <= SWEEP_TOLERANCE)
+        {
+            toi = t;
+            point = s1.primitive(i).contactPoint(s2.primitive(j));
+            return true;
+        }
+        if (t == 1.0)
+            return false;
+        t = v1 + v2 > 0.0 ? std::min(t + gap / (v1 + v2), qreal(1.0)) : 1.0;
+    }
+    // Too many steps: shapes graze each other, and are tested at their end.
+    gap = c1.separation(c2, i, j);
+    toi = 1.0;
+    if (gap > 0.0)
+        return false;
+    point = c1.primitive(i).contactPoint(c2.primitive(j));
+    return true;
+}
+
 bool LogicalScene::intersect(MasterShape *f1)
 {
+    candidates(f1, _candidates);
+    for (auto f : _candidates)
+        if (intersect(f, f1))
+            return true;
+    return false;
+}
+
+void LogicalScene::narrowPhase()
+{
+    // Small chunks balance the load between threads, since pairs with
+    // bitmaps are much slower to test than the others.
+    const size_t chunk = std::max<size_t>(_pairs.size() / (8 * nb_threads), 16);
+    PerfCounters counters;
+    for (size_t b = _next_pair.fetch_add(chunk); b < _pairs.size(); b = _next_pair.fetch_add(chunk))
+    {
+        const size_t e = std::min(b + chunk, _pairs.size());
+        for (size_t i = b; i < e; ++i)
+            _results[i] = intersect(formes[_pairs[i].first], formes[_pairs[i].second], _witnesses[i], counters);
+    }
+    std::lock_guard<std::mutex> lock(_perf_mutex);
+    perf += counters;
+}
+
+void LogicalScene::step()
+{
+    ++_tick;
+    for (auto f : formes)
+        update(f);
+    // Each unordered pair is seen from its lowest id only.
+    _old_pairs.swap(_pairs);
+    _old_witnesses.swap(_witnesses);
+    _pairs.clear();
+    for (auto f1 : formes)
+    {
+        candidates(f1, _candidates);
+        for (auto f2 : _candidates)
+            if (f1->_id < f2->_id)
+                _pairs.push_back(std::make_pair(f1->_id, f2->_id));
+    }
+    // Witnesses of the pairs already tested by the previous step are
+    // found by merging both sorted lists.
+    std::sort(_pairs.begin(), _pairs.end());
+    _witnesses.resize(_pairs.size());
+    size_t k = 0;
+    for (size_t i = 0; i < _pairs.size(); ++i)
+    {
+        while (k < _old_pairs.size() && _old_pairs[k] < _pairs[i])
+            ++k;
+        if (k < _old_pairs.size() && _old_pairs[k] == _pairs[i])
+            _witnesses[i] = _old_witnesses[k];
+        else
+            _witnesses[i].kind = Witness::None;
+    }
+    _results.resize(_pairs.size());
+    _next_pair = 0;
+    perf.tick = _tick;
+    perf.pairs = _pairs.size();
+    perf.witness_hits = perf.culled = perf.random_points = perf.inside_tests = 0;
+    const int nb_workers = std::min<int>(nb_threads, int(_pairs.size() / 64));
+    for (int i = 1; i < nb_workers; ++i)
+        _pool.start([this]() { narrowPhase(); });
+    narrowPhase();
+    _pool.waitForDone();
+    // Continuous detection sweeps shapes from their current primitives.
+    if (continuous)
+    {
+        _previous.resize(formes.size());
+        for (auto f : formes)
+            _previous[f->_id] = f->compiled();
+    }
+    _colliding.assign(formes.size(), 0);
+    _old_contacts.swap(_contacts);
+    _contacts.clear();
+    for (size_t i = 0; i < _pairs.size(); ++i)
+        if (_results[i])
+        {
+            _colliding[_pairs[i].first] = _colliding[_pairs[i].second] = 1;
+            _contacts.push_back(Contact{_pairs[i].first, _pairs[i].second, world.wrap(_witnesses[i].p),
+                                        _witnesses[i].toi});
+        }
+    // Both lists of contacts are sorted by ids, so that their changes are
+    // found by a merge.
+    _began.clear();
+    _ended.clear();
+    k = 0;
+    for (const Contact &c : _contacts)
+    {
+        for (; k < _old_contacts.size() && std::make_pair(_old_contacts[k].id1, _old_contacts[k].id2) <
+                                                  std::make_pair(c.id1, c.id2); ++k)
+            _ended.push_back(_old_contacts[k]);
+        if (k < _old_contacts.size() && _old_contacts[k].id1 == c.id1 && _old_contacts[k].id2 == c.id2)
+            ++k;
+        else
+            _began.push_back(c);
+    }
+    _ended.insert(_ended.end(), _old_contacts.begin() + k, _old_contacts.end());
+    for (auto f : formes)
+        f->setCurrentState(_colliding[f->_id] ? MasterShape::Collision : MasterShape::Ok);
+}
+
+void LogicalScene::tick()
+{
+    QElapsedTimer timer;
+    if (instrumented)
+        timer.start();
+    // Shapes are wrapped around the world without branches, and setPos()
+    // does nothing for the ones that stay inside.
     for (auto f : formes)
-        if ((f != f1) && intersect(f, f1))
+    {
+        f->advance(1);
+        f->setPos(world.wrap(f->pos()));
+    }
+    if (instrumented)
+        perf.move_ns = timer.nsecsElapsed(), timer.restart();
+    step();
+    if (instrumented)
+    {
+        perf.collision_ns = timer.nsecsElapsed();
+        // The row of the previous tick has had the time to be painted,
+        // and the row of this tick waits for its painting.
+        flushPerf();
+        std::lock_guard<std::mutex> lock(_perf_mutex);
+        _pending = perf;
+        _pending.paint_ns = 0;
+        _perf_pending = true;
+    }
+    // Recording stops when shapes are added or removed.
+    if (recorder && !recorder->record())
+        recorder = nullptr;
+}
+
+void LogicalScene::setPerfOutput(QTextStream *out)
+{
+    _perf_out = out;
+    if (out)
+    {
+        instrumented = true;
+        *out << PerfCounters::csvHeader() << "\n";
+    }
+}
+
+void LogicalScene::addPaintTime(quint64 tick, qint64 ns)
+{
+    std::lock_guard<std::mutex> lock(_perf_mutex);
+    // Paintings of ticks already written are dropped.
+    if (_perf_pending && _pending.tick == tick)
+        _pending.paint_ns += ns;
+}
+
+void LogicalScene::flushPerf()
+{
+    std::lock_guard<std::mutex> lock(_perf_mutex);
+    if (_perf_pending && _perf_out)
+    {
+        _pending.writeCsv(*_perf_out);
+        _perf_out->flush();
+    }
+    _perf_pending = false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// class PerfCounters
+///////////////////////////////////////////////////////////////////////////////
+
+void PerfCounters::reset()
+{
+    tick = pairs = witness_hits = culled = random_points = inside_tests = 0;
+    move_ns = collision_ns = paint_ns = 0;
+}
+
+PerfCounters &PerfCounters::operator+=(const PerfCounters &other)
+{
+    witness_hits += other.witness_hits;
+    culled += other.culled;
+    random_points += other.random_points;
+    inside_tests += other.inside_tests;
+    return *this;
+}
+
+const char *PerfCounters::csvHeader()
+{
+    return "tick,pairs,witness_hits,culled,random_points,inside_tests,move_ns,collision_ns,paint_ns";
+}
+
+void PerfCounters::writeCsv(QTextStream &out) const
+{
+    out << tick << ',' << pairs << ',' << witness_hits << ',' << culled << ','
+        << random_points << ',' << inside_tests << ',' << move_ns << ','
+        << collision_ns << ',' << paint_ns << "\n";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// class Simulation
+///////////////////////////////////////////////////////////////////////////////
+
+Simulation::Simulation(LogicalScene *scene, int period_ms)
+        : _scene(scene), _period_ms(period_ms), _stop(false), _published(0), _read(0) {}
+
+void Simulation::stop()
+{
+    _stop = true;
+}
+
+bool Simulation::latest(std::vector<ShapeSnapshot> &snapshots, PerfCounters &perf)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_published == _read)
+        return false;
+    _read = _published;
+    snapshots = _front;
+    perf = _front_perf;
+    return true;
+}
+
+void Simulation::restore(const std::vector<MasterShape *> &twins, const std::vector<ShapeSnapshot> &snapshots)
+{
+    const size_t n = std::min(twins.size(), snapshots.size());
+    for (size_t i = 0; i < n; ++i)
+        twins[i]->restore(snapshots[i]);
+}
+
+void Simulation::run()
+{
+    typedef std::chrono::steady_clock Clock;
+    const Clock::duration period = std::chrono::milliseconds(_period_ms);
+    Clock::time_point next = Clock::now();
+    while (!_stop)
+    {
+        _scene->tick();
+        _back.resize(_scene->formes.size());
+        for (size_t i = 0; i < _back.size(); ++i)
+            _back[i] = _scene->formes[i]->snapshot();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _front.swap(_back);
+            _front_perf = _scene->perf;
+            ++_published;
+        }
+        // Ticks late by more than a few periods are dropped rather than
+        // run in a burst.
+        next += period;
+        const Clock::time_point now = Clock::now();
+        if (now > next + 4 * period)
+            next = now;
+        else
+            std::this_thread::sleep_until(next);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// class Recorder
+///////////////////////////////////////////////////////////////////////////////
+
+// Fields of a shape in logs, quantized to 1/256 pixel or degree.
+static const int LOG_FIELDS = 4;
+static void quantize(const ShapeSnapshot &s, qint64 *q)
+{
+    q[0] = qint64(::llround(s.pos.x() * 256.0));
+    q[1] = qint64(::llround(s.pos.y() * 256.0));
+    q[2] = qint64(::llround(s.rotation * 256.0));
+    q[3] = qint64(::llround(s.angle * 256.0));
+}
+
+static void putVarint(std::vector<uchar> &out, quint64 v)
+{
+    for (; v >= 0x80; v >>= 7)
+        out.push_back(uchar(v | 0x80));
+    out.push_back(uchar(v));
+}
+
+static void putZigzag(std::vector<uchar> &out, qint64 v)
+{
+    putVarint(out, (quint64(v) << 1) ^ quint64(v >> 63));
+}
+
+// Reads a varint from [p, end), or returns false if it is truncated.
+static bool getVarint(const uchar *&p, const uchar *end, quint64 &v)
+{
+    v = 0;
+    for (int shift = 0; p != end && shift < 64; shift += 7)
+    {
+        const uchar b = *p++;
+        v |= quint64(b & 0x7f) << shift;
+        if (!(b & 0x80))
             return true;
+    }
     return false;
 }
+
+static bool getZigzag(const uchar *&p, const uchar *end, qint64 &v)
+{
+    quint64 u;
+    if (!getVarint(p, end, u))
+        return false;
+    v = qint64(u >> 1) ^ -qint64(u & 1);
+    return true;
+}
+
+Recorder::Recorder(const LogicalScene &scene)
+        : _scene(scene), _tick(0), _done(false), _failed(false) {}
+
+Recorder::~Recorder()
+{
+    close();
+}
+
+bool Recorder::close()
+{
+    if (_writer.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_buffer.empty())
+                _queue.push_back(std::move(_buffer));
+            _done = true;
+        }
+        _cond.notify_one();
+        _writer.join();
+    }
+    return !_failed;
+}
+
+bool Recorder::open(const QString &name)
+{
+    _file.setFileName(name);
+    // Nothing is recorded into a log that could not be opened.
+    _failed = true;
+    if (!_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+    const std::vector<MasterShape *> &formes = _scene.formes;
+    SceneHeader header = {{'C', 'O', 'L', 'R'}, LOG_VERSION, quint64(formes.size()), _scene.world.size,
+                          _scene.world.border};
+    std::vector<ShapeRecord> records(formes.size());
+    _last.resize(formes.size() * LOG_FIELDS);
+    _states.resize(formes.size());
+    for (size_t i = 0; i < formes.size(); ++i)
+    {
+        records[i] = formes[i]->record();
+        quantize(formes[i]->snapshot(), &_last[i * LOG_FIELDS]);
+        _states[i] = formes[i]->currentState();
+    }
+    // Shapes may already collide, so that replays start from the same
+    // states.
+    const qint64 size = qint64(records.size() * sizeof(ShapeRecord));
+    if (_file.write(reinterpret_cast<const char *>(&header), sizeof(header)) != qint64(sizeof(header)) ||
+        _file.write(reinterpret_cast<const char *>(records.data()), size) != size ||
+        _file.write(_states.data(), qint64(_states.size())) != qint64(_states.size()))
+    {
+        _file.close();
+        return false;
+    }
+    _failed = false;
+    _writer = std::thread([this]() { write(); });
+    return true;
+}
+
+bool Recorder::record()
+{
+    const std::vector<MasterShape *> &formes = _scene.formes;
+    // Ticks give a byte of flags per shape of the header.
+    if (_failed || formes.size() != _states.size())
+    {
+        _failed = true;
+        return false;
+    }
+    const quint64 tick = _scene.perf.tick;
+    putVarint(_buffer, tick - _tick);
+    _tick = tick;
+    qint64 q[LOG_FIELDS];
+    for (size_t i = 0; i < formes.size(); ++i)
+    {
+        quantize(formes[i]->snapshot(), q);
+        qint64 *last = &_last[i * LOG_FIELDS];
+        const char state = formes[i]->currentState();
+        uchar flags = 0;
+        if (q[0] != last[0] || q[1] != last[1])
+            flags |= Moved;
+        if (q[2] != last[2])
+            flags |= Rotated;
+        if (q[3] != last[3])
+            flags |= Turned;
+        if (state != _states[i])
+            flags |= StateChanged | (state == MasterShape::Collision ? Colliding : 0);
+        _buffer.push_back(flags);
+        if (flags & Moved)
+        {
+            putZigzag(_buffer, q[0] - last[0]);
+            putZigzag(_buffer, q[1] - last[1]);
+        }
+        if (flags & Rotated)
+            putZigzag(_buffer, q[2] - last[2]);
+        if (flags & Turned)
+            putZigzag(_buffer, q[3] - last[3]);
+        std::copy(q, q + LOG_FIELDS, last);
+        _states[i] = state;
+    }
+    // The writer gets blocks of about 64 KiB. A slow disk slows the
+    // simulation down instead of queuing blocks without end.
+    if (_buffer.size() >= 64 * 1024)
+    {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _space.wait(lock, [this]() { return _queue.size() < MAX_QUEUED_BLOCKS; });
+            _queue.push_back(std::move(_buffer));
+        }
+        _buffer.clear();
+        _cond.notify_one();
+    }
+    return true;
+}
+
+void Recorder::write()
+{
+    std::vector< std::vector<uchar> > blocks;
+    bool written = true;
+    for (bool done = false; !done;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cond.wait(lock, [this]() { return _done || !_queue.empty(); });
+            blocks.swap(_queue);
+            done = _done;
+        }
+        _space.notify_one();
+        // After a failed write, blocks are dropped so that record() is
+        // never blocked. Ticks encoded before the scene changed are still
+        // written.
+        for (const std::vector<uchar> &b : blocks)
+            if (written && _file.write(reinterpret_cast<const char *>(b.data()), qint64(b.size())) != qint64(b.size()))
+                written = false;
+        if (!written)
+            _failed = true;
+        blocks.clear();
+    }
+    if (!written || !_file.flush())
+        _failed = true;
+    _file.close();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// class Replay
+///////////////////////////////////////////////////////////////////////////////
+
+Replay::Replay()
+        : scene(1), tick(0), _data(nullptr), _end(nullptr), _ptr(nullptr) {}
+
+Replay::~Replay()
+{
+    if (_data)
+        _file.unmap(const_cast<uchar *>(_data));
+}
+
+bool Replay::open(const QString &name, QPixmap &asteroid_pixmap)
+{
+    _file.setFileName(name);
+    if (!_file.open(QIODevice::ReadOnly) || _file.size() < qint64(sizeof(SceneHeader)))
+        return false;
+    _data = _file.map(0, _file.size());
+    if (!_data)
+        return false;
+    _end = _data + _file.size();
+    SceneHeader header;
+    std::copy(_data, _data + sizeof(header), reinterpret_cast<uchar *>(&header));
+    if (!std::equal(header.magic, header.magic + 4, "COLR") || header.version != LOG_VERSION ||
+        header.count > quint64(_end - _data - sizeof(header)) / (sizeof(ShapeRecord) + 1) ||
+        !World(header.size, header.border).isValid())
+        return false;
+    // Logs with invalid records are rejected before any shape is built,
+    // as scene files are.
+    const ShapeRecord *records = reinterpret_cast<const ShapeRecord *>(_data + sizeof(header));
+    for (quint64 i = 0; i < header.count; ++i)
+        if (!records[i].valid())
+            return false;
+    scene.setWorld(World(header.size, header.border));
+    ShapeArena::Scope scope(scene.arena);
+    for (quint64 i = 0; i < header.count; ++i)
+        scene.add(MasterShape::fromRecord(records[i], asteroid_pixmap));
+    const uchar *states = reinterpret_cast<const uchar *>(records + header.count);
+    _last.resize(scene.formes.size() * LOG_FIELDS);
+    for (size_t i = 0; i < scene.formes.size(); ++i)
+    {
+        if (states[i] != MasterShape::Ok && states[i] != MasterShape::Collision)
+            return false;
+        ShapeSnapshot s = scene.formes[i]->snapshot();
+        s.state = MasterShape::State(states[i]);
+        scene.formes[i]->restore(s);
+        quantize(s, &_last[i * LOG_FIELDS]);
+    }
+    _ptr = states + header.count;
+    return true;
+}
+
+bool Replay::next()
+{
+    // A truncated tick, as left by an interrupted recording, ends the log.
+    const uchar *p = _ptr;
+    quint64 dt;
+    if (!getVarint(p, _end, dt))
+        return false;
+    const size_t n = scene.formes.size();
+    std::vector<qint64> last(_last);
+    std::vector<uchar> flags(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (p == _end)
+            return false;
+        flags[i] = *p++;
+        qint64 *q = &last[i * LOG_FIELDS];
+        // Each flag gives the fields whose delta follows.
+        const int fields[LOG_FIELDS] = {Recorder::Moved, Recorder::Moved, Recorder::Rotated, Recorder::Turned};
+        for (int k = 0; k < LOG_FIELDS; ++k)
+        {
+            qint64 d;
+            if (!(flags[i] & fields[k]))
+                continue;
+            if (!getZigzag(p, _end, d))
+                return false;
+            q[k] += d;
+        }
+    }
+    _ptr = p;
+    _last.swap(last);
+    tick += dt;
+    for (size_t i = 0; i < n; ++i)
+    {
+        MasterShape *f = scene.formes[i];
+        const qint64 *q = &_last[i * LOG_FIELDS];
+        MasterShape::State state = f->currentState();
+        if (flags[i] & Recorder::StateChanged)
+            state = (flags[i] & Recorder::Colliding) ? MasterShape::Collision : MasterShape::Ok;
+        if (flags[i] & (Recorder::Moved | Recorder::Rotated | Recorder::Turned | Recorder::StateChanged))
+            f->restore(ShapeSnapshot{QPointF(q[0] / 256.0, q[1] / 256.0), q[2] / 256.0, q[3] / 256.0, state});
+    }
+    return true;
+}
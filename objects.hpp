@@ -9,24 +9,321 @@
 #ifndef OBJECTS_HPP
 #define OBJECTS_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
 #include <vector>
 #include <QGraphicsItem>
+#include <QPainter>
+#include <QTransform>
+#include <QThread>
+#include <QFile>
+#include <QTextStream>
+#include <QThreadPool>
+#include <QBitmap>
 
 static const int IMAGE_SIZE = 600;
 static const int SZ_BD            = 100;
+/// Smallest side of a world. Rectangles of shapes must be smaller than
+/// half a period for the broad phase, and no shape is larger than the
+/// default world.
+static const double MIN_WORLD_SIZE = IMAGE_SIZE;
+/// Largest side of a world, given on the command line or read from a file.
+static const double MAX_WORLD_SIZE = 1e6;
+static const double Pi = 3.14159265358979323846264338327950288419717;
+
+/// @brief The square and toroidal world where the shapes of a logical
+/// scene move.
+///
+/// Shapes live in [-border, size+border)^2: a shape leaving it on one
+/// side comes back on the other side, one period further. Wrapping is
+/// done with floor() and no branches.
+struct World
+{
+    qreal size;   ///< side of the world, from MIN_WORLD_SIZE to MAX_WORLD_SIZE
+    qreal border; ///< margin where shapes leave the world before being wrapped
+
+    World( qreal s = IMAGE_SIZE, qreal b = SZ_BD ) : size( s ), border( b ) {}
+    /// @return 'true' iff the size is in [MIN_WORLD_SIZE, MAX_WORLD_SIZE]
+    /// and the border in [0, MAX_WORLD_SIZE], so that shapes are smaller
+    /// than half a period and the grid of a scene can be sized with ints.
+    /// Worlds read from files are checked with it.
+    bool isValid() const
+    { return size >= MIN_WORLD_SIZE && size <= MAX_WORLD_SIZE && border >= 0.0 && border <= MAX_WORLD_SIZE; }
+    /// @return the period of the world along both axes.
+    qreal period() const { return size + 2 * border; }
+    /// @return the coordinate \a v wrapped in [-border, size+border).
+    qreal wrap( qreal v ) const
+    { return v - period() * std::floor( ( v + border ) / period() ); }
+    QPointF wrap( const QPointF& p ) const
+    { return QPointF( wrap( p.x() ), wrap( p.y() ) ); }
+    /// @return the shortest displacement equal to \a d up to whole periods.
+    qreal delta( qreal d ) const
+    { return d - period() * std::floor( d / period() + 0.5 ); }
+    QPointF delta( const QPointF& d ) const
+    { return QPointF( delta( d.x() ), delta( d.y() ) ); }
+    /// @return the translation by whole periods that brings the point \a to
+    /// closest to the point \a from (zero unless they are across a seam).
+    QPointF offset( const QPointF& from, const QPointF& to ) const
+    { return delta( to - from ) - ( to - from ); }
+    /// @return 'true' iff both rectangles, whose sides are smaller than
+    /// half a period, overlap once moved closest to each other.
+    bool intersects( const QRectF& a, const QRectF& b ) const
+    {
+        const QPointF d = delta( b.center() - a.center() );
+        return std::fabs( d.x() ) <= 0.5 * ( a.width() + b.width() )
+            && std::fabs( d.y() ) <= 0.5 * ( a.height() + b.height() );
+    }
+};
+
+/// @brief A disk or an oriented box in scene coordinates. Shapes that
+/// are unions of disks and rectangles are described by a list of
+/// primitives, which allows an exact test of their collisions.
+struct Primitive
+{
+    enum Kind { DiskKind, BoxKind };
+    Kind        kind;
+    QPointF c;      ///< center
+    QPointF u;      ///< unit vector along the first side of the box
+    qreal     hx;   ///< half width of the box, or radius of the disk
+    qreal     hy;   ///< half height of the box, or radius of the disk
+    QRectF    box;  ///< bounding rectangle
+    qreal     w;    ///< area of the primitive
+
+    /// @return 'true' iff this primitive and \a other have a common point.
+    bool intersects( const Primitive& other ) const;
+    /// @return a lower bound of the distance between this primitive and
+    /// \a other, which is not positive if they intersect.
+    qreal separation( const Primitive& other ) const;
+    /// @return a point of both this primitive and \a other if they
+    /// intersect, otherwise a point between them.
+    QPointF contactPoint( const Primitive& other ) const;
+};
+
+/// @brief A small and fast pseudo-random generator (xoshiro256**).
+///
+/// Each shape, and each pair of shapes tested by a logical scene, has
+/// its own stream derived from a master seed, so that random points can
+/// be drawn from several threads with reproducible results.
+struct RandomStream
+{
+    uint64_t s[4];
+
+    /// Builds the stream number \a stream of the master seed \a seed.
+    explicit RandomStream( uint64_t seed = 1, uint64_t stream = 0 );
+    /// @return 64 random bits.
+    uint64_t generate64()
+    {
+        const uint64_t result = rotl(s[1] * 5, 7) * 9;
+        const uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+    /// @return a random number in [0,1).
+    double generateDouble() { return (generate64() >> 11) * (1.0 / 9007199254740992.0); }
+    /// @return a random integer in [0,n).
+    uint32_t bounded( uint32_t n ) { return uint32_t(((generate64() >> 32) * n) >> 32); }
+
+protected:
+    static uint64_t rotl( uint64_t x, int k ) { return (x << k) | (x >> (64 - k)); }
+};
+
+/// @brief Walker's alias table, to draw an index with given weights in
+/// constant time.
+struct AliasTable
+{
+    std::vector<double>   prob;  ///< probability of keeping each index
+    std::vector<uint32_t> alias; ///< index drawn otherwise
+
+    /// Builds the table of the (non-negative, not all zero) \a weights.
+    void build( const std::vector<double>& weights );
+    size_t size() const { return prob.size(); }
+    /// @return an index i drawn with probability weights[i]/sum(weights).
+    size_t sample( RandomStream& rng ) const
+    {
+        const double u = rng.generateDouble() * prob.size();
+        const size_t i = std::min( size_t(u), prob.size() - 1 );
+        return u - i < prob[i] ? i : alias[i];
+    }
+};
+
+struct GraphicalShape;
+
+/// @brief The primitives of a master shape, in scene coordinates, stored
+/// as a structure of arrays.
+///
+/// It allows to test points and to draw random points in a shape with
+/// tight loops, without virtual calls nor trigonometric functions.
+/// Shapes containing an ImageShape are not compiled: their bitmap is no
+/// union of disks and boxes, so they are only tested by sampling.
+struct CompiledShape
+{
+    /// 'true' iff the shape is made of disks and boxes, otherwise (e.g.
+    /// for shapes with an ImageShape) the arrays are empty.
+    bool                        exact;
+    std::vector<unsigned char> kind;
+    std::vector<qreal>         cx, cy; ///< centers
+    std::vector<qreal>         ux, uy; ///< first axis of boxes
+    std::vector<qreal>         hx, hy; ///< half sizes of boxes, or radii of disks
+    std::vector<QRectF>        box;    ///< bounding rectangles
+    AliasTable                 table;  ///< primitives weighted by their area
+    /// Bound of the distance travelled by any point of the shape since
+    /// its first compilation (infinite if the shape is not exact).
+    qreal                      travel;
+
+    CompiledShape();
+    /// Fills this compiled shape with the primitives of \a f.
+    void compile( const GraphicalShape* f );
+    size_t size() const { return kind.size(); }
+    /// @return the primitive at index \a i.
+    Primitive primitive( size_t i ) const;
+    bool        isInside( const QPointF& p ) const;
+    /// Tests \a n points at once, given by their coordinates \a xs and
+    /// \a ys relative to \a origin, which keeps them precise as floats
+    /// far from the origin of the scene.
+    void        isInsideBatch( const float* xs, const float* ys, uint8_t* out, size_t n,
+                               const QPointF& origin = QPointF() ) const;
+    QPointF randomPoint( RandomStream& rng ) const;
+    /// @return 'true' iff a primitive of this shape intersects a primitive of \a other.
+    bool        intersects( const CompiledShape& other ) const;
+    /// @return 0 if the primitives \a i of this shape and \a j of \a other
+    /// intersect, otherwise a positive lower bound of the distance between
+    /// both shapes, reached by the primitives \a i and \a j.
+    qreal       separation( const CompiledShape& other, size_t& i, size_t& j ) const;
+    /// Moves all the primitives of this shape by \a d.
+    void        translate( const QPointF& d );
+    /// Fills this shape with the primitives of \a from moved towards the
+    /// ones of \a to, at time \a t in [0,1]: centers are interpolated
+    /// linearly and axes are rotated from one to the other.
+    void        interpolate( const CompiledShape& from, const CompiledShape& to, qreal t );
+    /// @return a bound of the speed of any point of the shape moving from
+    /// \a from to this shape in a time 1 (see interpolate), or infinity if
+    /// the move cannot be interpolated, e.g. when a primitive has been
+    /// wrapped around the world \a world.
+    qreal       sweepSpeed( const CompiledShape& from, const World& world ) const;
+};
+
+
+/// @brief A region of memory where whole trees of shapes are allocated
+/// contiguously and released at once.
+///
+/// While a ShapeArena::Scope exists in a thread, the shapes created by
+/// this thread are allocated in its arena. Deleting them runs their
+/// destructors but releases no memory: the arena releases all of it when
+/// destroyed, so it must outlive its shapes.
+struct ShapeArena
+{
+    /// Makes \a arena the current arena of the calling thread, until
+    /// this scope is destroyed.
+    struct Scope {
+        explicit Scope( ShapeArena& arena );
+        ~Scope();
+        ShapeArena* _previous;
+    };
+
+    /// @param block_size the size of the blocks taken from the heap.
+    explicit ShapeArena( size_t block_size = 64 * 1024 );
+    ShapeArena( const ShapeArena& ) = delete;
+    ShapeArena& operator=( const ShapeArena& ) = delete;
+    ~ShapeArena();
+    /// @return \a size bytes aligned on 16 bytes.
+    void* allocate( size_t size );
+    /// @return the number of bytes allocated so far.
+    size_t size() const { return _size; }
+    /// @return the current arena of the calling thread, or 0 if shapes
+    /// are allocated on the heap.
+    static ShapeArena* current();
+
+protected:
+    std::vector<char*> _blocks;
+    char*              _ptr;
+    char*              _end;
+    size_t             _block_size;
+    size_t             _size;
+};
 
 
 /// @brief Abstract class that describes a graphical object with additional
 /// methods for testing collisions.
 struct GraphicalShape : public QGraphicsItem
 {
-    virtual QPointF randomPoint() const = 0;
+    /// Shapes are allocated in the current ShapeArena, if any, otherwise
+    /// on the heap.
+    static void* operator new( size_t size );
+    static void  operator delete( void* p );
+    /// @return a random point of this shape, drawn from \a rng.
+    virtual QPointF randomPoint( RandomStream& rng ) const = 0;
+    /// @return the area of this shape, which weights random points
+    /// (the area of the bounding rectangle by default).
+    virtual qreal       area() const;
     virtual bool        isInside( const QPointF& p ) const = 0;
+    /// Tests \a n points at once, given by their coordinates \a xs and
+    /// \a ys, and sets out[i] to 1 iff the i-th point is inside.
+    virtual void        isInsideBatch( const float* xs, const float* ys, uint8_t* out, size_t n ) const;
+    /// Outputs the primitives composing this shape, mapped by \a t.
+    /// @param t a rigid transformation from this shape to the scene.
+    /// @param out (modified) the list where primitives are appended.
+    /// @return 'false' if this shape is not made of disks and boxes.
+    virtual bool        primitives( const QTransform& t, std::vector<Primitive>& out ) const;
     // Already in QGraphicsItem
     // virtual QRectF    boundingRect() const override;
+
+    GraphicalShape();
+    /// Tells this shape, and the shapes containing it, that their
+    /// bounding rectangles are about to change. Each of them calls
+    /// prepareGeometryChange so that its scene is kept up to date.
+    void                invalidateBounds();
+
+protected:
+    /// Bounding rectangle cached by the shapes which are not trivially
+    /// bounded, valid unless \a _bounds_dirty. Caches are filled by
+    /// LogicalScene::update before the narrow phase reads them from
+    /// several threads.
+    mutable QRectF      _bounds;
+    mutable bool        _bounds_dirty;
 };
 
 
+struct ShapeSnapshot;
+
+/// @brief A master shape as stored in a scene file (see LogicalScene::save).
+///
+/// The kind of the shape gives its composite structure; records are
+/// stored in the byte order of the machine.
+struct ShapeRecord
+{
+    enum Kind : quint8 { AsteroidKind, SpaceTruckKind, EnterpriseKind, NiceAsteroidKind,
+                         UnknownKind = 0xff };
+    quint8  kind;
+    quint8  reserved[7];
+    quint32 cok, cko; ///< colors, as QRgb
+    double  x, y;     ///< position in the scene
+    double  rotation; ///< in degrees
+    double  angle;    ///< angle of an inner transformation, if any
+    double  speed;
+    double  radius;   ///< radius of asteroids
+
+    /// @return 'true' iff MasterShape::fromRecord can build this record.
+    bool known() const { return kind <= NiceAsteroidKind; }
+    /// @return 'true' iff this record is known and its fields are finite
+    /// and within the largest world, so that it can be added to a
+    /// logical scene. Records read from files are checked with it.
+    bool valid() const;
+};
+
 /// @brief Polymorphic class that represents the top class of any complex
 /// shape.
 ///
@@ -39,20 +336,68 @@ struct MasterShape : public GraphicalShape
     void setGraphicalShape( GraphicalShape* f );
     virtual void        paint( QPainter *painter, const QStyleOptionGraphicsItem *option,
                                                  QWidget *widget) override;
-    virtual QPointF randomPoint() const override;
+    virtual QPointF randomPoint( RandomStream& rng ) const override;
+    virtual qreal       area() const override;
     virtual bool        isInside( const QPointF& p ) const override;
+    virtual void        isInsideBatch( const float* xs, const float* ys, uint8_t* out, size_t n ) const override;
+    /// Tests \a n points at once, given by their coordinates \a xs and
+    /// \a ys relative to \a origin (see CompiledShape::isInsideBatch).
+    void                isInsideBatch( const float* xs, const float* ys, uint8_t* out, size_t n,
+                                       const QPointF& origin ) const;
     virtual QRectF    boundingRect() const override;
+    virtual bool        primitives( const QTransform& t, std::vector<Primitive>& out ) const override;
+    /// @return the primitives of this shape, which are computed again
+    /// only if it has moved since the last call. Shapes with an
+    /// ImageShape are not compiled, their CompiledShape::exact is
+    /// 'false'.
+    const CompiledShape& compiled() const;
+    /// Tells this shape that its primitives and its bounds have changed.
+    void                        invalidate();
 
-    // Checks if this shape collides with another shape and forces also
-    // the shapes to stay in the graphical view.
+    // Forces the shapes to stay in the graphical view. Collisions are
+    // checked afterwards by LogicalScene::step.
     virtual void        advance(int step) override;
     State                     currentState() const;
+    /// Sets the state of this shape, and repaints it if it changes.
+    void                        setCurrentState( State s );
     QColor                    currentColor() const;
+    /// @return the position, rotation and state of this shape.
+    virtual ShapeSnapshot snapshot() const;
+    /// Moves this shape, and sets its state, as given by \a s.
+    virtual void        restore( const ShapeSnapshot& s );
+    /// @return the record of this shape in a scene file. Each kind of
+    /// shape gives its own, from the fields common to all shapes given
+    /// by this definition, whose kind is ShapeRecord::UnknownKind.
+    virtual ShapeRecord record() const = 0;
+    /// @return a new master shape built and placed as given by \a r, or 0
+    /// if its kind is unknown.
+    /// @param asteroid_pixmap the image of nice asteroids.
+    static MasterShape* fromRecord( const ShapeRecord& r, QPixmap& asteroid_pixmap );
+
+    /// Index of this shape in its logical scene, or -1 if it is not stored
+    /// in any logical scene.
+    int                         _id;
+    /// Random stream of the moves of this shape, set by LogicalScene::add.
+    RandomStream          _rng;
 
 protected:
+    virtual QVariant    itemChange( GraphicsItemChange change, const QVariant& value ) override;
+
     GraphicalShape* _f;
     State                     _state;
     QColor                    _cok, _cko;
+    mutable CompiledShape _compiled;
+    mutable bool                _dirty;
+};
+
+/// @brief What is displayed of a master shape, as published by the
+/// simulation thread.
+struct ShapeSnapshot
+{
+    QPointF            pos;
+    qreal              rotation;
+    qreal              angle;    ///< angle of an inner transformation, if any
+    MasterShape::State state;
 };
 
 /// @brief An asteroid is a simple shape that moves linearly in some direction.
@@ -61,8 +406,10 @@ struct Asteroid : public MasterShape
     Asteroid( QColor cok, QColor cko, double speed, double r );
     // moves the asteroid forward according to its speed.
     virtual void        advance(int step) override;
+    virtual ShapeRecord record() const override;
 protected:
     double                    _speed;
+    double                    _r;
 };
 
 /// @brief A disk is a simple graphical shape.
@@ -74,9 +421,12 @@ struct Disk : public GraphicalShape
     Disk( qreal r, const MasterShape* master_shape );
     virtual void        paint( QPainter *painter, const QStyleOptionGraphicsItem *option,
                                                  QWidget *widget) override;
-    virtual QPointF randomPoint() const override;
+    virtual QPointF randomPoint( RandomStream& rng ) const override;
+    virtual qreal       area() const override;
     virtual bool        isInside( const QPointF& p ) const override;
+    virtual void        isInsideBatch( const float* xs, const float* ys, uint8_t* out, size_t n ) const override;
     virtual QRectF    boundingRect() const override;
+    virtual bool        primitives( const QTransform& t, std::vector<Primitive>& out ) const override;
     const qreal         _r;
     const MasterShape* _master_shape;
 };
@@ -86,9 +436,12 @@ struct Rectangle : public GraphicalShape
     Rectangle( QPointF upLeft ,QPointF downRight, const MasterShape* master_shape );
     virtual void        paint( QPainter *painter, const QStyleOptionGraphicsItem *option,
                                                  QWidget *widget) override;
-    virtual QPointF randomPoint() const override;
+    virtual QPointF randomPoint( RandomStream& rng ) const override;
+    virtual qreal       area() const override;
     virtual bool        isInside( const QPointF& p ) const override;
+    virtual void        isInsideBatch( const float* xs, const float* ys, uint8_t* out, size_t n ) const override;
     virtual QRectF    boundingRect() const override;
+    virtual bool        primitives( const QTransform& t, std::vector<Primitive>& out ) const override;
     const QPointF         _ul;
     const QPointF         _dr;
     const MasterShape* _master_shape;
@@ -101,20 +454,30 @@ struct Union : public GraphicalShape
     Union();
     virtual void        paint( QPainter *painter, const QStyleOptionGraphicsItem *s,
                                                  QWidget *w) override;
-    QPointF randomPoint() const override;
+    QPointF randomPoint( RandomStream& rng ) const override;
+    qreal       area() const override;
     bool        isInside( const QPointF& p ) const override;
+    void        isInsideBatch( const float* xs, const float* ys, uint8_t* out, size_t n ) const override;
     QRectF    boundingRect() const override;
+    bool        primitives( const QTransform& t, std::vector<Primitive>& out ) const override;
     GraphicalShape* _s1;
     GraphicalShape* _s2;
-    mutable bool _state;
+    /// Sub-shapes of this union that are not unions themselves, and
+    /// their table weighted by area, so that random points are uniform
+    /// (up to the overlaps of sub-shapes).
+    std::vector< const GraphicalShape* > _leaves;
+    AliasTable _table;
 };
 
 struct Transformation: public GraphicalShape 
 {
     Transformation(GraphicalShape* f, QPointF dx = QPoint(), qreal angle=0.0);
-    QPointF randomPoint() const override;
+    QPointF randomPoint( RandomStream& rng ) const override;
+    qreal       area() const override;
     bool        isInside( const QPointF& p ) const override;
+    void        isInsideBatch( const float* xs, const float* ys, uint8_t* out, size_t n ) const override;
     QRectF    boundingRect() const override;
+    bool        primitives( const QTransform& t, std::vector<Primitive>& out ) const override;
     virtual void        paint( QPainter *painter, const QStyleOptionGraphicsItem *option,
                                                  QWidget *widget) override;
     void setAngle(double a);
@@ -123,23 +486,248 @@ struct Transformation: public GraphicalShape
     qreal _a;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// Static shapes
+///////////////////////////////////////////////////////////////////////////////
+
+// Shapes whose structure and dimensions are known at compile time are
+// composed as types (DiskT, RectT, TransformT, UnionT) instead of trees
+// of graphical shapes. A static shape has static members only, like
+// the ones of DiskT, so that the compiler inlines all its calls and
+// folds its constants. It is given to a master shape by a StaticShape.
+
+/// @brief A disk of radius \a R centered at the origin.
+template <int R>
+struct DiskT
+{
+    /// @return 'true' iff the point (\a x, \a y) is inside.
+    static bool isInside( qreal x, qreal y ) { return x * x + y * y <= R * R; }
+    static QRectF boundingRect() { return QRectF( -R, -R, 2 * R, 2 * R ); }
+    static qreal area() { return Pi * R * R; }
+    static QPointF randomPoint( RandomStream& rng )
+    {
+        qreal x, y;
+        do {
+            x = rng.generateDouble() * 2.0 - 1.0;
+            y = rng.generateDouble() * 2.0 - 1.0;
+        } while ( x * x + y * y > 1.0 );
+        return QPointF( x * R, y * R );
+    }
+    /// Appends the primitive of this shape, mapped by \a t, to \a out.
+    static void primitives( const QTransform& t, std::vector<Primitive>& out )
+    {
+        const QPointF c = t.map( QPointF( 0.0, 0.0 ) );
+        out.push_back( Primitive{ Primitive::DiskKind, c, QPointF( t.m11(), t.m12() ), qreal( R ), qreal( R ),
+                                  QRectF( c.x() - R, c.y() - R, 2.0 * R, 2.0 * R ), area() } );
+    }
+    /// Draws this shape with the brush of \a painter.
+    static void paint( QPainter* painter ) { painter->drawEllipse( QPointF( 0.0, 0.0 ), R, R ); }
+};
+
+/// @brief The rectangle from (\a X1, \a Y1) to (\a X2, \a Y2).
+template <int X1, int Y1, int X2, int Y2>
+struct RectT
+{
+    static bool isInside( qreal x, qreal y ) { return x >= X1 && x <= X2 && y >= Y1 && y <= Y2; }
+    static QRectF boundingRect() { return QRectF( X1, Y1, X2 - X1, Y2 - Y1 ); }
+    static qreal area() { return qreal( X2 - X1 ) * ( Y2 - Y1 ); }
+    static QPointF randomPoint( RandomStream& rng )
+    {
+        const qreal x = rng.generateDouble() * ( X2 - X1 ) + X1;
+        return QPointF( x, rng.generateDouble() * ( Y2 - Y1 ) + Y1 );
+    }
+    static void primitives( const QTransform& t, std::vector<Primitive>& out )
+    {
+        const QPointF c = t.map( QPointF( 0.5 * ( X1 + X2 ), 0.5 * ( Y1 + Y2 ) ) );
+        const QPointF u( t.m11(), t.m12() );
+        const qreal hx = 0.5 * ( X2 - X1 ), hy = 0.5 * ( Y2 - Y1 );
+        const qreal ex = std::fabs( u.x() ) * hx + std::fabs( u.y() ) * hy;
+        const qreal ey = std::fabs( u.y() ) * hx + std::fabs( u.x() ) * hy;
+        out.push_back( Primitive{ Primitive::BoxKind, c, u, hx, hy,
+                                  QRectF( c.x() - ex, c.y() - ey, 2.0 * ex, 2.0 * ey ), area() } );
+    }
+    static void paint( QPainter* painter ) { painter->drawRect( boundingRect() ); }
+};
+
+/// @brief The static shape \a S rotated by \a A degrees, then moved by
+/// (\a DX, \a DY).
+template <class S, int DX, int DY, int A = 0>
+struct TransformT
+{
+    static qreal cosA() { return std::cos( A * Pi / 180.0 ); }
+    static qreal sinA() { return std::sin( A * Pi / 180.0 ); }
+    static bool isInside( qreal x, qreal y )
+    {
+        x -= DX;
+        y -= DY;
+        return S::isInside( x * cosA() + y * sinA(), y * cosA() - x * sinA() );
+    }
+    static QRectF boundingRect()
+    {
+        // The rotated bounding rectangle of S, around its rotated center.
+        const QRectF r = S::boundingRect();
+        const qreal c = cosA(), s = sinA();
+        const QPointF m( r.center().x() * c - r.center().y() * s + DX,
+                         r.center().x() * s + r.center().y() * c + DY );
+        const qreal ex = 0.5 * ( std::fabs( c ) * r.width() + std::fabs( s ) * r.height() );
+        const qreal ey = 0.5 * ( std::fabs( s ) * r.width() + std::fabs( c ) * r.height() );
+        return QRectF( m.x() - ex, m.y() - ey, 2.0 * ex, 2.0 * ey );
+    }
+    static qreal area() { return S::area(); }
+    static QPointF randomPoint( RandomStream& rng )
+    {
+        const QPointF p = S::randomPoint( rng );
+        return QPointF( p.x() * cosA() - p.y() * sinA() + DX, p.y() * cosA() + p.x() * sinA() + DY );
+    }
+    static void primitives( const QTransform& t, std::vector<Primitive>& out )
+    {
+        S::primitives( QTransform().translate( DX, DY ).rotate( A ) * t, out );
+    }
+    static void paint( QPainter* painter )
+    {
+        painter->save();
+        painter->translate( DX, DY );
+        painter->rotate( A );
+        S::paint( painter );
+        painter->restore();
+    }
+};
+
+/// @brief The union of the static shapes \a S1 and \a S2.
+template <class S1, class S2>
+struct UnionT
+{
+    static bool isInside( qreal x, qreal y ) { return S1::isInside( x, y ) || S2::isInside( x, y ); }
+    static QRectF boundingRect() { return S1::boundingRect() | S2::boundingRect(); }
+    /// Overlaps of both shapes are counted twice.
+    static qreal area() { return S1::area() + S2::area(); }
+    /// Random points are taken in each shape in proportion to its area.
+    static QPointF randomPoint( RandomStream& rng )
+    {
+        return rng.generateDouble() * area() < S1::area() ? S1::randomPoint( rng ) : S2::randomPoint( rng );
+    }
+    static void primitives( const QTransform& t, std::vector<Primitive>& out )
+    {
+        S1::primitives( t, out );
+        S2::primitives( t, out );
+    }
+    static void paint( QPainter* painter )
+    {
+        S1::paint( painter );
+        S2::paint( painter );
+    }
+};
+
+/// @brief The graphical shape of the static shape \a S, which plugs it
+/// into a master shape as a single item.
+template <class S>
+struct StaticShape : public GraphicalShape
+{
+    StaticShape( const MasterShape* master_shape ) : _master_shape( master_shape ) {}
+    QPointF randomPoint( RandomStream& rng ) const override { return S::randomPoint( rng ); }
+    qreal       area() const override { return S::area(); }
+    bool        isInside( const QPointF& p ) const override { return S::isInside( p.x(), p.y() ); }
+    void        isInsideBatch( const float* xs, const float* ys, uint8_t* out, size_t n ) const override
+    {
+        for ( size_t i = 0; i < n; ++i )
+            out[ i ] = S::isInside( xs[ i ], ys[ i ] );
+    }
+    QRectF    boundingRect() const override { return S::boundingRect(); }
+    bool        primitives( const QTransform& t, std::vector<Primitive>& out ) const override
+    {
+        S::primitives( t, out );
+        return true;
+    }
+    virtual void        paint( QPainter *painter, const QStyleOptionGraphicsItem *,
+                                                 QWidget *) override
+    {
+        painter->setBrush( _master_shape->currentColor() );
+        S::paint( painter );
+    }
+    const MasterShape* _master_shape;
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // ImageShape
 ///////////////////////////////////////////////////////////////////////////////
 
 
+/// @brief The mask of a pixmap, decoded once and shared by all the image
+/// shapes displaying this pixmap.
+struct ImageMask
+{
+    QBitmap     bitmap; ///< the mask, as given by QPixmap::mask
+    int         width;  ///< width of the mask
+    int         height; ///< height of the mask
+    int         words;  ///< number of 64 bits words per row of \a bits
+    /// The mask as a bitset, row by row (bit x%64 of word y*words+x/64).
+    std::vector<uint64_t> bits;
+    /// Indices y*width+x of the pixels of the mask, to draw random
+    /// points without rejection.
+    std::vector<uint32_t> pixels;
+    /// Bounding box of the pixels of the mask.
+    QRect       bbox;
+
+    /// Decodes the mask of \a pixmap. Use ImageMask::get instead.
+    explicit ImageMask( const QPixmap& pixmap );
+    /// @return 'true' iff the pixel (x,y) is in the mask.
+    bool contains( int x, int y ) const
+    {
+        return x >= 0 && y >= 0 && x < width && y < height &&
+               ((bits[size_t(y) * words + (x >> 6)] >> (x & 63)) & 1);
+    }
+    /// @return the mask of \a pixmap, which is decoded only if no other
+    /// shape holds the mask of this pixmap.
+    static std::shared_ptr<const ImageMask> get( const QPixmap& pixmap );
+};
+
+/// @brief Frames of a pixmap pre-rotated every STEP degrees, shared by
+/// the image shapes of this pixmap, so that painting them is a plain
+/// blit. Frames are built when first painted, possibly tinted by the
+/// color of collisions.
+struct SpriteAtlas
+{
+    /// Angle between two successive frames, in degrees.
+    static const int STEP = 2;
+
+    struct Frame {
+        QPixmap pixmap;
+        QPointF offset; ///< position of the top left corner of \a pixmap
+    };
+
+    QPixmap _pixmap;
+    /// Frames by angle, for each tint given by its validity and color.
+    std::map< std::pair<bool, QRgb>, std::vector<Frame> > _frames;
+
+    explicit SpriteAtlas( const QPixmap& pixmap );
+    /// @return the frame closest to the rotation of angle \a a (in
+    /// degrees), tinted by \a tint if it is valid.
+    const Frame& frame( qreal a, const QColor& tint = QColor() );
+    /// @return the atlas of \a pixmap, shared as ImageMask::get does.
+    static std::shared_ptr<SpriteAtlas> get( const QPixmap& pixmap );
+};
+
 struct ImageShape: public GraphicalShape 
 {
     ImageShape(const QPixmap & pixmap, const MasterShape* master_shape );
-    QPointF randomPoint() const override;
+    QPointF randomPoint( RandomStream& rng ) const override;
+    qreal       area() const override;
     bool        isInside( const QPointF& p ) const override;
+    /// @return the bounding box of the opaque pixels of the image, with
+    /// a margin for the smoothing of rotated frames and for their angle,
+    /// which is off by up to SpriteAtlas::STEP/2 degrees. It is
+    /// smaller than the pixmap, whose transparent border is neither
+    /// tested nor repainted.
     QRectF    boundingRect() const override;
     virtual void        paint( QPainter *painter, const QStyleOptionGraphicsItem *option,
                                                  QWidget *widget) override;
+    void        isInsideBatch( const float* xs, const float* ys, uint8_t* out, size_t n ) const override;
     const QPixmap& _pixmap;
-    QBitmap _mask;
-    QImage _mask_img;
+    std::shared_ptr<const ImageMask> _mask;
+    std::shared_ptr<SpriteAtlas> _atlas;
     const MasterShape* _master_shape;
+    /// Margin of the bounding box, which covers the error of the frames.
+    qreal _margin;
 };
 ///////////////////////////////////////////////////////////////////////////////
 // class NiceAsteroid
@@ -149,6 +737,9 @@ struct NiceAsteroid : public MasterShape
     NiceAsteroid( QColor cok, QColor cko, double speed, QPixmap& asteroid_pixmap);
     // moves the asteroid forward according to its speed.
     virtual void        advance(int step) override;
+    virtual ShapeSnapshot snapshot() const override;
+    virtual void        restore( const ShapeSnapshot& s ) override;
+    virtual ShapeRecord record() const override;
 protected:
     double                    _speed;
     Transformation* _t;
@@ -157,45 +748,466 @@ protected:
 
 struct SpaceTruck : public MasterShape
 {
+    /// A long body, a short neck and a square cabin.
+    typedef UnionT< RectT<-80, -10, 0, 10>,
+                    UnionT< RectT<10, -10, 30, 10>, RectT<0, -3, 10, 3> > > Shape;
     SpaceTruck( QColor cok, QColor cko, double speed);
     // moves the asteroid forward according to its speed.
     virtual void        advance(int step) override;
+    virtual ShapeRecord record() const override;
 protected:
     double                    _speed;
 };
 
 struct Enterprise : public MasterShape
 {
+    /// A hull and a saucer (head), two nacelles (back) and two pylons
+    /// (legs).
+    typedef RectT<-25, -5, 25, 5> Pylon;
+    typedef UnionT< UnionT< RectT<-40, -9, 40, 9>, TransformT< DiskT<40>, 70, 0 > >,
+                    UnionT< UnionT< TransformT< TransformT< Pylon, -30, 0 >, 0, 0, 45 >,
+                                    TransformT< TransformT< Pylon, -30, 0 >, 0, 0, -45 > >,
+                            UnionT< TransformT< RectT<-100, -8, 0, 8>, 0, 40 >,
+                                    TransformT< RectT<-100, -8, 0, 8>, 0, -40 > > > > Shape;
     Enterprise( QColor cok, QColor cko, double speed);
     // moves the asteroid forward according to its speed.
     virtual void        advance(int step) override;
+    virtual ShapeRecord record() const override;
 protected:
     double                    _speed;
 };
 
+/// @brief Number of shapes of each kind in a scene built by
+/// LogicalScene::populate.
+struct SceneParams
+{
+    int asteroids;
+    int trucks;
+    int enterprises;
+    int nices;
+};
+
+/// @brief What a logical scene did during one tick.
+///
+/// Pairs and points are always counted, by each thread on its own, which
+/// costs almost nothing. Times are only measured when
+/// LogicalScene::instrumented is set.
+struct PerfCounters
+{
+    quint64 tick;          ///< number of the tick
+    quint64 pairs;         ///< candidate pairs given by the broad phase
+    quint64 witness_hits;  ///< pairs decided by their witness of the previous tick
+    quint64 culled;        ///< pairs among them known to be apart without any test
+    quint64 random_points; ///< random points drawn in shapes
+    quint64 inside_tests;  ///< points tested in shapes
+    qint64  move_ns;       ///< time spent moving shapes
+    qint64  collision_ns;  ///< time spent detecting collisions
+    qint64  paint_ns;      ///< time spent painting this tick in the view, in CSV rows
+
+    PerfCounters() { reset(); }
+    void reset();
+    /// Adds the pair and point counts of \a other to these counters.
+    PerfCounters& operator+=( const PerfCounters& other );
+    /// @return the names of the columns written by writeCsv().
+    static const char* csvHeader();
+    /// Writes these counters as one line of CSV.
+    void writeCsv( QTextStream& out ) const;
+};
+
+struct Recorder;
+
 /// @brief A class to store master shapes and to test their possible
-/// collisions with a randomized algorithm.
+/// collisions.
+///
+/// Shapes are indexed in a uniform grid which tiles the toroidal world
+/// (broad phase), so that only shapes with overlapping bounding
+/// rectangles, maybe across a seam of the world, are tested (narrow
+/// phase).
+/// Shapes made of disks and rectangles are tested exactly with their
+/// primitives, other shapes with a randomized algorithm. Candidate
+/// pairs of the narrow phase are shared among a pool of threads.
 struct LogicalScene {
+    /// How points are drawn to test shapes that are not made of disks
+    /// and rectangles.
+    enum Sampling {
+        /// nb_tested random points of each shape are tested in the other.
+        Uniform,
+        /// Points of a low discrepancy sequence (Halton) are taken in the
+        /// intersection of the bounding rectangles, and their number is
+        /// proportional to the area of this intersection.
+        Adaptive
+    };
+
+    /// Data stored by the broad phase for each master shape.
+    struct Proxy {
+        QRectF   box;   ///< bounding rectangle of the shape in scene coordinates
+        QRect    cells; ///< range of grid cells covered by \a box, from a cell of the first period
+        unsigned mark;  ///< last query that visited this shape
+        QRectF   last;  ///< bounding rectangle at the last update
+    };
+
+    /// @brief A pair of shapes colliding at the last step.
+    struct Contact {
+        int     id1, id2; ///< ids of the shapes, with id1 < id2
+        QPointF point;    ///< a common point of both shapes, wrapped in the world
+        qreal   toi;      ///< time of impact during the step, in [0,1]
+    };
+
+    /// What the narrow phase remembers of a pair of shapes from one step
+    /// to the next, so that it is usually tested again in constant time.
+    struct Witness {
+        enum Kind : unsigned char {
+            None,       ///< nothing is known
+            Primitives, ///< primitives \a i and \a j of both shapes collided
+            Point,      ///< the point \a p was in both shapes
+            Separated   ///< shapes were at least \a gap apart
+        };
+        Kind    kind;
+        quint32 i, j;
+        /// In scene coordinates. It is also the contact point of colliding
+        /// pairs, whatever their kind.
+        QPointF p;
+        qreal   gap;
+        /// Sum of the travels of both compiled shapes when \a gap was measured.
+        qreal   travel;
+        /// Time of impact during the last step, in [0,1], if they collided.
+        qreal   toi;
+    };
+
     std::vector< MasterShape*> formes;
     int nb_tested;
+    /// Sampling of shapes that cannot be tested exactly (Adaptive by default).
+    Sampling sampling;
+    /// Master seed of the placement of shapes and of all random streams.
+    quint64 seed;
+    /// The world where shapes move (see setWorld).
+    World world;
+    /// Side of a square cell of the broad phase grid: the side given to
+    /// the constructor, slightly enlarged so that cells tile a period of
+    /// the world.
+    qreal cell_size;
+    /// Number of cells along one side of a period of the world.
+    int nb_cells;
+    /// Ids of the shapes overlapping each cell. Cells are hashed in a
+    /// table whose size does not depend on the size of the world, so
+    /// that distant cells may share the same bucket.
+    std::vector< std::vector<int> > cells;
+    /// Broad phase data of each shape, indexed by MasterShape::_id.
+    std::vector< Proxy > proxies;
+    /// Number of threads running the narrow phase.
+    int nb_threads;
+    /// Memory of the shapes created by populate().
+    ShapeArena arena;
+    /// 'true' iff tick() measures the time of its phases.
+    bool instrumented;
+    /// Counters of the last tick.
+    PerfCounters perf;
+    /// Recorder of the ticks, or 0.
+    Recorder* recorder;
+    /// 'true' iff shapes made of disks and boxes are tested along their
+    /// moves since the previous step (continuous collision detection),
+    /// and not only at their positions, so that fast shapes do not pass
+    /// through each other. The broad phase then stores swept bounding
+    /// rectangles. It must be set before shapes are added.
+    bool continuous;
 
     /// Builds a logical scene where collisions are detected by checking
     /// \a n random points within shapes.
     ///
     /// @param n any positive integer.
-    LogicalScene( int n );
+    /// @param cell the side of a cell of the broad phase grid.
+    LogicalScene( int n, qreal cell = 64.0 );
+    /// Writes the counters of the last tick, if not already written.
+    ~LogicalScene();
+    /// Sets the number of threads running the narrow phase.
+    /// @param n any positive integer (1 runs it in the calling thread).
+    void setThreadCount( int n );
+    /// Sets the world where shapes move, and rebuilds the broad phase
+    /// grid for it.
+    void setWorld( const World& w );
+    /// Creates the shapes given by \a params, places them around the
+    /// center of the world and adds them to this logical scene. They are
+    /// allocated in \a arena, so they must be deleted before this
+    /// logical scene.
+    /// @param params the number of shapes of each kind.
+    /// @param asteroid_pixmap the image of nice asteroids, which must
+    /// outlive them.
+    void populate( const SceneParams& params, QPixmap& asteroid_pixmap );
+    /// Saves the shapes of this logical scene in the binary file \a name:
+    /// a header (magic "COLS", version, number of shapes, size and
+    /// border of the world) followed by one ShapeRecord per shape.
+    /// @return 'true' iff the file was written, which fails if a shape
+    /// has no known kind.
+    bool save( const QString& name ) const;
+    /// Adds the shapes stored in the binary file \a name by save(). The
+    /// file is mapped in memory and shapes are allocated in \a arena.
+    /// @param asteroid_pixmap the image of nice asteroids, which must
+    /// outlive them.
+    /// The world of the file becomes the world of this scene, which must
+    /// be empty if their worlds differ.
+    /// @return 'true' iff the file was a valid scene file whose shapes
+    /// are all of known kinds. Otherwise no shape is added.
+    bool load( const QString& name, QPixmap& asteroid_pixmap );
+    /// Adds the master shape \a f to this logical scene. It must be
+    /// called once \a f is positioned.
+    /// @param f any master shape not already in a logical scene.
+    void add( MasterShape* f );
+    /// Updates the broad phase after the shape \a f has moved.
+    /// @param f any master shape of this logical scene.
+    void update( MasterShape* f );
+    /// Outputs the shapes of this logical scene, except \a f1, whose
+    /// bounding rectangle overlaps the one of \a f1.
+    /// @param f1 any master shape.
+    /// @param result (modified) the list of overlapping shapes.
+    void candidates( const MasterShape* f1, std::vector< MasterShape* >& result );
     /// Given two shapes \a f1 and \a f2, returns if they collide.
+    /// Random points are drawn from a stream given by the seed, the
+    /// current tick and the ids of the shapes.
     /// @param f1 any master shape.
     /// @param f2 any different master shape.
     /// @return 'true' iff they collide, i.e. have a common intersection.
     bool intersect( MasterShape* f1, MasterShape* f2 );
+    /// Given two shapes \a f1 and \a f2, returns if they collide.
+    /// @param rng the random stream used by shapes that are not made of
+    /// disks and rectangles.
+    bool intersect( MasterShape* f1, MasterShape* f2, RandomStream& rng );
+    /// Given two shapes \a f1 and \a f2 made of disks and boxes, returns
+    /// if they collide while moving from their positions at the previous
+    /// step to their current positions, by conservative advancement.
+    /// @param offset the translation of \a f2 next to \a f1, as given by pairOffset().
+    /// @param toi (modified) the first time of impact, in [0,1], if any.
+    /// @param gap (modified) a lower bound of their final distance otherwise.
+    /// @param point (modified) the contact point at the time of impact.
+    /// @return 'true' iff they collide.
+    bool sweep( MasterShape* f1, MasterShape* f2, const QPointF& offset, qreal& toi, qreal& gap,
+                QPointF& point ) const;
+    /// @return the translation by whole periods of the world that brings
+    /// \a f2 next to \a f1, chosen from the centers of their rectangles
+    /// in the broad phase, so that both phases see the same pair.
+    QPointF pairOffset( const MasterShape* f1, const MasterShape* f2 ) const;
     /// @param f1 any master shape.
     /// @return 'true' iff it collides with a different master shape stored in this logical scene.
     bool intersect( MasterShape* f1 );
+    /// Checks the collisions of all the shapes of this logical scene,
+    /// once every shape has moved, and updates their states. Each pair
+    /// of shapes is tested at most once.
+    void step();
+    /// Moves all the shapes of this logical scene, then checks their
+    /// collisions with step(), and records them if a recorder is set.
+    void tick();
+    /// @return the number of pairs of shapes tested by the last step().
+    size_t nbCandidatePairs() const { return _pairs.size(); }
+    /// @return the pairs of shapes colliding at the last step(), sorted
+    /// by ids. The buffer is reused from one step to the next.
+    const std::vector<Contact>& contacts() const { return _contacts; }
+    /// @return the contacts of the last step() that were not contacts at
+    /// the step before.
+    const std::vector<Contact>& contactsBegan() const { return _began; }
+    /// @return the contacts of the step before the last step() that are
+    /// not contacts anymore, as they were.
+    const std::vector<Contact>& contactsEnded() const { return _ended; }
+    /// @return the number of pairs of the last step() decided by their
+    /// witness of the previous step.
+    size_t nbWitnessHits() const { return perf.witness_hits; }
+    /// Measures the time of each tick and writes its counters to \a out
+    /// as CSV, starting with a header line.
+    /// @param out any stream, or 0 to stop writing counters.
+    void setPerfOutput( QTextStream* out );
+    /// Adds \a ns to the painting time of the tick \a tick, if its
+    /// counters are not written yet. It may be called from any thread.
+    void addPaintTime( quint64 tick, qint64 ns );
+    /// Writes the counters of the last tick to the output given by
+    /// setPerfOutput(), if not already written. It is done by tick() at
+    /// the end of the next tick, so that the painting of the tick is
+    /// known, and by the destructor.
+    void flushPerf();
+
+protected:
+    /// @return the range of cells covered by the rectangle \a r.
+    QRect cellRange( const QRectF& r ) const;
+    /// @return the bucket of \a cells storing the cell (\a x, \a y),
+    /// coordinates being taken modulo nb_cells. Cells have their own
+    /// bucket if there are enough of them, otherwise their coordinates
+    /// are mixed by a multiplicative hash.
+    std::vector<int>& bucket( int x, int y );
+    /// Tests the pair \a f1, \a f2 from its \a witness of the previous
+    /// step first, then as intersect() does, and updates \a witness.
+    /// @param counters (modified) where witness hits and points are counted.
+    bool intersect( MasterShape* f1, MasterShape* f2, Witness& witness, PerfCounters& counters );
+    /// Tests \a nb_tested random points of each shape in the other one.
+    /// @param offset the translation of \a f2 next to \a f1, as given by pairOffset().
+    /// @param witness (modified) a common point, if any.
+    /// @param counters (modified) where points are counted.
+    bool intersectUniform( MasterShape* f1, MasterShape* f2, const QPointF& offset, RandomStream& rng,
+                           QPointF& witness, PerfCounters& counters );
+    /// Tests points of a randomly shifted Halton sequence in the
+    /// intersection of the bounding rectangles of \a f1 and \a f2. Their
+    /// number is \a nb_tested times the area of this intersection times
+    /// the sum of the inverses of the areas of both shapes, up to
+    /// \a nb_tested, so that as many collisions are found as by
+    /// intersectUniform.
+    /// @param offset the translation of \a f2 next to \a f1, as given by pairOffset().
+    /// @param witness (modified) a common point, if any.
+    /// @param counters (modified) where points are counted.
+    bool intersectAdaptive( MasterShape* f1, MasterShape* f2, const QPointF& offset, RandomStream& rng,
+                            QPointF& witness, PerfCounters& counters );
+    /// @return the stream of random points of the pair \a f1, \a f2 for
+    /// the current tick.
+    RandomStream pairStream( const MasterShape* f1, const MasterShape* f2 ) const;
+    /// Tests the pairs of _pairs and stores their results in _results,
+    /// by chunks taken from a shared counter until there is none left.
+    void narrowPhase();
+
+    /// Smallest side of the cells, as given to the constructor.
+    qreal                       _min_cell_size;
+    /// Number of bits of the hash of cells, or 0 if each cell has its
+    /// own bucket.
+    int                         _bucket_bits;
+    unsigned                    _query;
+    quint64                     _tick;
+    std::vector< MasterShape* > _candidates;
+    std::vector< char >         _colliding;
+    /// Pairs of the current and of the previous step, sorted, with
+    /// their witnesses.
+    std::vector< std::pair<int, int> > _pairs, _old_pairs;
+    std::vector< Witness >      _witnesses, _old_witnesses;
+    /// Contacts of the last step and of the step before, and their changes.
+    std::vector< Contact >      _contacts, _old_contacts, _began, _ended;
+    /// Compiled shapes at the previous step (continuous detection).
+    std::vector< CompiledShape > _previous;
+    std::vector< char >         _results;
+    std::atomic<size_t>         _next_pair;
+    std::mutex                  _perf_mutex;
+    QTextStream*                _perf_out;
+    /// Counters of the last tick, not written yet if \a _perf_pending.
+    PerfCounters                _pending;
+    bool                        _perf_pending;
+    QThreadPool                 _pool;
 };
 
 
 
+/// @brief Records the moves and states of the shapes of a logical scene
+/// in an append-only binary log, for an offline Replay.
+///
+/// The log starts with a header (magic "COLR", version, number of
+/// shapes, size and border of the world), the ShapeRecord of each shape
+/// and a byte per shape giving its state (MasterShape::State) when the
+/// log was opened. Each tick follows as the difference with the previous
+/// tick in varints, then, for each shape, a byte of flags and the zigzag
+/// varint deltas of the fields that changed. Positions and angles are
+/// quantized to 1/256 pixel or degree. Ticks are encoded by the
+/// simulation thread and written by a background thread.
+struct Recorder
+{
+    enum Flags {
+        Moved = 1, Rotated = 2, Turned = 4, ///< position, rotation, inner angle changed
+        StateChanged = 8, Colliding = 16   ///< state changed, and its new value
+    };
+
+    explicit Recorder( const LogicalScene& scene );
+    /// Closes the log.
+    ~Recorder();
+    /// Creates the log \a name and writes the shapes of the scene.
+    /// @return 'true' iff the file was created and written.
+    bool open( const QString& name );
+    /// Encodes the current tick of the scene. Ticks are queued for the
+    /// writer thread, and the caller waits while MAX_QUEUED_BLOCKS
+    /// blocks are queued, so that a slow disk does not fill the memory.
+    /// @return 'false' if the scene has gained or lost shapes since the
+    /// log was opened, or if the log could not be written, in which case
+    /// nothing is recorded anymore.
+    bool record();
+    /// Writes the remaining ticks and closes the log.
+    /// @return 'true' iff every tick given to record() has been written.
+    bool close();
+
+    /// Largest number of blocks of ticks waiting for the writer thread.
+    static const size_t MAX_QUEUED_BLOCKS = 16;
+
+protected:
+    /// Body of the writer thread.
+    void write();
+
+    const LogicalScene&              _scene;
+    QFile                            _file;
+    quint64                          _tick;
+    std::vector<qint64>              _last;   ///< quantized fields of each shape
+    std::vector<char>                _states; ///< last state of each shape
+    std::vector<uchar>               _buffer; ///< ticks not yet given to the writer
+    std::mutex                       _mutex;
+    std::condition_variable          _cond;   ///< signals blocks to the writer
+    std::condition_variable          _space;  ///< signals room in the queue
+    std::vector< std::vector<uchar> > _queue;
+    bool                             _done;
+    /// The scene has changed, or the log could not be written.
+    std::atomic<bool>                _failed;
+    std::thread                      _writer;
+};
+
+/// @brief Plays a log written by a Recorder, without testing collisions.
+struct Replay
+{
+    /// The shapes of the log.
+    LogicalScene scene;
+    /// Number of the last played tick.
+    quint64      tick;
+
+    Replay();
+    ~Replay();
+    /// Maps the log \a name and builds its shapes, in their recorded
+    /// states, in the world of the log.
+    /// @param asteroid_pixmap the image of nice asteroids.
+    /// @return 'true' iff the file is a valid log.
+    bool open( const QString& name, QPixmap& asteroid_pixmap );
+    /// Moves the shapes, and sets their states, to the next tick.
+    /// @return 'false' at the end of the log.
+    bool next();
+
+protected:
+    QFile                _file;
+    const uchar*         _data;
+    const uchar*         _end;
+    const uchar*         _ptr;
+    std::vector<qint64>  _last;
+};
+
+/// @brief Runs the ticks of a logical scene in its own thread, at a fixed
+/// time step, and publishes a snapshot of its shapes after each tick.
+///
+/// The snapshots are double buffered: the simulation fills the back
+/// buffer, then swaps it with the front one, which the display copies.
+/// Shapes of the logical scene must not be read by other threads while
+/// the simulation runs; they are displayed through twin shapes instead.
+struct Simulation : public QThread
+{
+    /// @param scene the simulated scene.
+    /// @param period_ms the time step, in milliseconds (0 runs ticks
+    /// without waiting).
+    Simulation( LogicalScene* scene, int period_ms );
+    /// Asks the simulation to stop after its current tick.
+    void stop();
+    /// Copies the last published snapshots and counters, if they are new.
+    /// @param snapshots (modified) one snapshot per shape of the scene.
+    /// @param perf (modified) the counters of the last tick.
+    /// @return 'true' iff a tick was published since the last call.
+    bool latest( std::vector<ShapeSnapshot>& snapshots, PerfCounters& perf );
+    /// Restores each shape of \a twins from the snapshot of same index.
+    static void restore( const std::vector<MasterShape*>& twins,
+                         const std::vector<ShapeSnapshot>& snapshots );
+
+protected:
+    void run() override;
+
+    LogicalScene*               _scene;
+    int                         _period_ms;
+    std::atomic<bool>           _stop;
+    std::mutex                  _mutex;
+    std::vector<ShapeSnapshot>  _front, _back;
+    PerfCounters                _front_perf;
+    quint64                     _published, _read;
+};
+
 extern LogicalScene* logical_scene;
 
 #endif